@@ -0,0 +1,862 @@
+/*	--*- c -*--
+ * Copyright (C) 2015 Enrico Scholz <enrico.scholz@sigma-chemnitz.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Runs the libfbtest renderers and the grab path against memory backed
+ * framebuffers of various geometries and pixel formats. */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/param.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "libfbtest.h"
+
+#define CMD_HELP		0x1000
+#define CMD_BASELINE		0x2000
+#define CMD_WRITE_BASELINE	0x2001
+#define CMD_THRESHOLD		0x2002
+#define CMD_FILTER		0x2003
+
+/* minimum duration of a single measurement; the median of the samples
+ * is reported */
+#define BENCH_MIN_NS		(20 * 1000000ull)
+#define BENCH_SAMPLES		9
+
+/* size of the memcpy() reference kernel which is run between the
+ * samples; results are compared relative to it so that changes of the
+ * cpu frequency or of the memory bandwidth cancel out */
+#define REF_SIZE		(4u << 20)
+
+/* number of times a result above the threshold is measured again before
+ * it is reported as a regression; baseline entries are the median of
+ * this many additional measurements.  These run after all other ones so
+ * that a slow phase of the machine does not affect all of them. */
+#define BENCH_RETRIES		2
+#define SETPIX_BATCH		65536u
+
+#define ARRAY_SIZE(_a)		(sizeof(_a) / sizeof (_a)[0])
+
+static struct option const
+BENCH_OPTIONS[] = {
+	{ "help",		no_argument,       0, CMD_HELP },
+	{ "baseline",		required_argument, 0, CMD_BASELINE },
+	{ "write-baseline",	required_argument, 0, CMD_WRITE_BASELINE },
+	{ "threshold",		required_argument, 0, CMD_THRESHOLD },
+	{ "filter",		required_argument, 0, CMD_FILTER },
+	{ 0,0,0,0 }
+};
+
+struct bench_format {
+	char const		*name;
+	unsigned int		bpp;
+	struct fb_bitfield	red;
+	struct fb_bitfield	green;
+	struct fb_bitfield	blue;
+};
+
+#define BF(_ofs, _len)	{ .offset = (_ofs), .length = (_len) }
+
+static struct bench_format const	FORMATS[] = {
+	{ "mono1",		 1, BF( 0,  1), BF( 0,  1), BF(0,  1) },
+	{ "grey2",		 2, BF( 0,  2), BF( 0,  2), BF(0,  2) },
+	{ "grey4",		 4, BF( 0,  4), BF( 0,  4), BF(0,  4) },
+	{ "pal8",		 8, BF( 0,  3), BF( 0,  3), BF(0,  2) },
+	{ "rgb565",		16, BF(11,  5), BF( 5,  6), BF(0,  5) },
+	{ "rgb888",		24, BF(16,  8), BF( 8,  8), BF(0,  8) },
+	{ "xrgb8888",		32, BF(16,  8), BF( 8,  8), BF(0,  8) },
+	{ "xrgb2101010",	32, BF(20, 10), BF(10, 10), BF(0, 10) },
+	{ "rgb161616",		48, BF(32, 16), BF(16, 16), BF(0, 16) },
+	{ "xrgb16161616",	64, BF(32, 16), BF(16, 16), BF(0, 16) },
+};
+
+#undef BF
+
+static struct {
+	unsigned int		xres;
+	unsigned int		yres;
+} const				GEOMETRIES[] = {
+	{  320,  240 },
+	{  640,  480 },
+	{ 1280,  720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+	{ 7680, 4320 },
+};
+
+enum bench_mode {
+	MODE_SOLID,
+	MODE_BARS,
+	MODE_DSHADE,
+	MODE_CROSS,
+	MODE_SETPIX,
+	MODE_GRAB,
+	MODE_BARS90,
+	MODE_GRAB90,
+	MODE_CHECKSUM,
+	MODE_GRABW,
+};
+
+static char const * const	MODE_NAMES[] = {
+	[MODE_SOLID]	= "solid",
+	[MODE_BARS]	= "bars",
+	[MODE_DSHADE]	= "dshade",
+	[MODE_CROSS]	= "cross",
+	[MODE_SETPIX]	= "setpix",
+	[MODE_GRAB]	= "grab",
+	[MODE_BARS90]	= "bars90",
+	[MODE_GRAB90]	= "grab90",
+	[MODE_CHECKSUM]	= "checksum",
+	[MODE_GRABW]	= "grabw",
+};
+
+struct bench_result {
+	char			mode[16];
+	char			format[16];
+	char			geometry[16];
+	double			ns_per_pix;
+	double			cycles_per_pix;	/* < 0 when not available */
+	double			mb_per_s;
+	/* time per pixel in units of the time memcpy() needs per byte */
+	double			ref_per_pix;
+};
+
+struct bench_env {
+	int			cycles_fd;
+	int			null_fd;	/* output of the grabw mode */
+
+	void			*ref_src;
+	void			*ref_dst;
+	unsigned int		ref_loops;
+};
+
+/* memory backed framebuffer with an upright and a rotated context */
+struct bench_fb {
+	struct fb_var_screeninfo	var;
+	int				fd;
+	void				*buf;
+	size_t				buf_size;
+
+	struct fbt_ctx			*ctx;
+	struct fbt_ctx			*ctx90;
+
+	void				*grab_buf;
+	size_t				grab_size;
+};
+
+/* result which is measured again at the end */
+struct bench_entry {
+	size_t				g;
+	size_t				f;
+	enum bench_mode			m;
+	struct bench_result const	*base;
+	struct bench_result		res[BENCH_RETRIES + 1];
+	unsigned int			num_res;
+};
+
+static bool bench_supported(enum bench_mode mode, struct bench_format const *fmt)
+{
+	switch (fmt->bpp) {
+	case 1:
+	case 2:
+	case 4:
+		return (mode != MODE_DSHADE && mode != MODE_CROSS &&
+			mode != MODE_BARS90 && mode != MODE_GRAB90);
+
+	case 8:
+		/* these modes are not implemented in palette mode */
+		return (mode != MODE_DSHADE && mode != MODE_CROSS &&
+			mode != MODE_GRAB && mode != MODE_GRAB90 &&
+			mode != MODE_GRABW);
+
+	default:
+		return true;
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* cpu time of the process; unlike the wall clock, this does not include
+ * time where other tasks or the hypervisor were running */
+static uint64_t cpu_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void bench_fb_free(struct bench_fb *fb)
+{
+	fbt_close(fb->ctx);
+	fbt_close(fb->ctx90);
+	free(fb->grab_buf);
+	munmap(fb->buf, fb->buf_size);
+	close(fb->fd);
+}
+
+static int bench_fb_init(struct bench_fb *fb, struct bench_format const *fmt,
+			 unsigned int xres, unsigned int yres)
+{
+	size_t		stride;
+
+	memset(fb, 0, sizeof *fb);
+
+	fb->var.xres           = xres;
+	fb->var.yres           = yres;
+	fb->var.xres_virtual   = xres;
+	fb->var.yres_virtual   = yres;
+	fb->var.bits_per_pixel = fmt->bpp;
+	fb->var.red            = fmt->red;
+	fb->var.green          = fmt->green;
+	fb->var.blue           = fmt->blue;
+
+	stride       = ((size_t)xres * fmt->bpp + 7) / 8;
+	fb->buf_size = stride * yres;
+
+	fb->fd = memfd_create("fbbench", MFD_CLOEXEC);
+	if (fb->fd < 0) {
+		perror("memfd_create()");
+		return -1;
+	}
+
+	if (ftruncate(fb->fd, fb->buf_size) < 0) {
+		perror("ftruncate()");
+		close(fb->fd);
+		return -1;
+	}
+
+	fb->buf = mmap(NULL, fb->buf_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fb->fd, 0);
+	if (fb->buf == MAP_FAILED) {
+		perror("mmap()");
+		close(fb->fd);
+		return -1;
+	}
+
+	/* fault in the pages so that they are not accounted to the first
+	 * measurement */
+	memset(fb->buf, 0, fb->buf_size);
+
+	fb->ctx   = fbt_attach(fb->buf, &fb->var);
+	fb->ctx90 = fbt_attach(fb->buf, &fb->var);
+
+	if (!fb->ctx || !fb->ctx90 || fbt_set_rotation(fb->ctx, 0) < 0 ||
+	    fbt_set_rotation(fb->ctx90, 90) < 0)
+		goto err;
+
+	fb->grab_size = fbt_grab_size(fb->ctx, NULL);
+	fb->grab_buf  = malloc(fb->grab_size);
+	if (!fb->grab_buf) {
+		perror("malloc()");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	bench_fb_free(fb);
+	return -1;
+}
+
+static void bench_run_once(struct bench_env const *env, struct bench_fb *fb,
+			   enum bench_mode mode)
+{
+	switch (mode) {
+	case MODE_SOLID:
+		fbt_fill(fb->ctx, fb->var.bits_per_pixel <= 8 ? 0x42 : 0x12345678);
+		break;
+
+	case MODE_BARS:
+		fbt_pattern(fb->ctx, FBT_PATTERN_BARS);
+		break;
+
+	case MODE_DSHADE:
+		fbt_pattern(fb->ctx, FBT_PATTERN_DSHADE);
+		break;
+
+	case MODE_CROSS:
+		fbt_pattern(fb->ctx, FBT_PATTERN_CROSS);
+		break;
+
+	case MODE_SETPIX: {
+		uint32_t	seed = 1;
+
+		for (unsigned int i = 0; i < SETPIX_BATCH; ++i) {
+			unsigned int	x, y;
+
+			seed = seed * 1103515245u + 12345u;
+			x    = (seed >> 8) % fb->var.xres;
+			seed = seed * 1103515245u + 12345u;
+			y    = (seed >> 8) % fb->var.yres;
+
+			fbt_set_pixel(fb->ctx, x, y, i);
+		}
+		break;
+	}
+
+	case MODE_GRAB:
+		fbt_grab(fb->ctx, fb->grab_buf, fb->grab_size);
+		break;
+
+	case MODE_BARS90:
+		fbt_pattern(fb->ctx90, FBT_PATTERN_BARS);
+		break;
+
+	case MODE_GRAB90:
+		fbt_grab(fb->ctx90, fb->grab_buf, fb->grab_size);
+		break;
+
+	case MODE_CHECKSUM:
+		fbt_checksum(fb->ctx);
+		break;
+
+	case MODE_GRABW: {
+		fbt_grab_write(fb->ctx, &env->null_fd, 1, NULL);
+		break;
+	}
+	}
+}
+
+static uint64_t bench_pixels(struct bench_fb const *fb, enum bench_mode mode)
+{
+	switch (mode) {
+	case MODE_CROSS:
+		return 2 * fb->var.xres;
+	case MODE_SETPIX:
+		return SETPIX_BATCH;
+	default:
+		return (uint64_t)fb->var.xres * fb->var.yres;
+	}
+}
+
+static uint64_t bench_cycles(struct bench_env const *env)
+{
+	uint64_t	v;
+
+	if (env->cycles_fd < 0 ||
+	    read(env->cycles_fd, &v, sizeof v) != sizeof v)
+		return 0;
+
+	return v;
+}
+
+struct bench_sample {
+	uint64_t		ns;
+	uint64_t		cpu_ns;
+	uint64_t		cycles;
+	double			rel;
+};
+
+/* runs the operation 'loops' times */
+static void bench_measure(struct bench_env const *env, struct bench_fb *fb,
+			  enum bench_mode mode, unsigned int loops,
+			  struct bench_sample *s)
+{
+	uint64_t	t0;
+	uint64_t	p0;
+	uint64_t	c0;
+
+	c0 = bench_cycles(env);
+	p0 = cpu_ns();
+	t0 = now_ns();
+
+	for (unsigned int i = 0; i < loops; ++i)
+		bench_run_once(env, fb, mode);
+
+	s->ns     = now_ns() - t0;
+	s->cpu_ns = cpu_ns() - p0;
+	s->cycles = bench_cycles(env) - c0;
+}
+
+/* returns the cpu time of the reference kernel */
+static uint64_t bench_ref_measure(struct bench_env const *env)
+{
+	uint64_t	t0 = cpu_ns();
+
+	for (unsigned int i = 0; i < env->ref_loops; ++i) {
+		memcpy(env->ref_dst, env->ref_src, REF_SIZE);
+		__asm__ __volatile__("" ::: "memory");
+	}
+
+	return cpu_ns() - t0;
+}
+
+static int bench_ref_init(struct bench_env *env)
+{
+	env->ref_src = malloc(REF_SIZE);
+	env->ref_dst = malloc(REF_SIZE);
+
+	if (!env->ref_src || !env->ref_dst) {
+		perror("malloc()");
+		return -1;
+	}
+
+	memset(env->ref_src, 0x5a, REF_SIZE);
+	memset(env->ref_dst, 0, REF_SIZE);
+
+	env->ref_loops = 1;
+	for (;;) {
+		uint64_t	t = bench_ref_measure(env);
+
+		if (t >= BENCH_MIN_NS || env->ref_loops >= (1u << 16))
+			break;
+
+		env->ref_loops = t == 0 ? env->ref_loops * 16 :
+			MAX(env->ref_loops * 2,
+			    env->ref_loops * BENCH_MIN_NS / t + 1);
+	}
+
+	return 0;
+}
+
+static void bench_ref_free(struct bench_env *env)
+{
+	free(env->ref_src);
+	free(env->ref_dst);
+}
+
+static int bench_sample_cmp(void const *a_v, void const *b_v)
+{
+	struct bench_sample const	*a = a_v;
+	struct bench_sample const	*b = b_v;
+
+	return a->ns < b->ns ? -1 : a->ns > b->ns;
+}
+
+static int bench_rel_cmp(void const *a_v, void const *b_v)
+{
+	struct bench_sample const	*a = a_v;
+	struct bench_sample const	*b = b_v;
+
+	return a->rel < b->rel ? -1 : a->rel > b->rel;
+}
+
+static void bench_one(struct bench_env const *env, struct bench_fb *fb,
+		      enum bench_mode mode, struct bench_result *res)
+{
+	unsigned int		loops = 1;
+	struct bench_sample	samples[BENCH_SAMPLES];
+	struct bench_sample	med;
+	uint64_t		pixels;
+	uint64_t		ref_bytes = (uint64_t)REF_SIZE * env->ref_loops;
+	uint64_t		ref_ns[BENCH_SAMPLES + 1];
+
+	/* calibrate so that a sample is long enough for the clock */
+	for (;;) {
+		struct bench_sample	s;
+
+		bench_measure(env, fb, mode, loops, &s);
+
+		if (s.ns >= BENCH_MIN_NS || loops >= (1u << 20))
+			break;
+
+		loops = s.ns == 0 ? loops * 16 : MAX(loops * 2,
+						      loops * BENCH_MIN_NS / s.ns + 1);
+	}
+
+	pixels = bench_pixels(fb, mode) * loops;
+
+	/* every sample is put between two runs of the reference kernel and
+	 * its cpu time is related to their mean */
+	ref_ns[0] = bench_ref_measure(env);
+	for (unsigned int i = 0; i < BENCH_SAMPLES; ++i) {
+		double	ref;
+
+		bench_measure(env, fb, mode, loops, &samples[i]);
+		ref_ns[i + 1] = bench_ref_measure(env);
+
+		ref = (ref_ns[i] + ref_ns[i + 1]) / 2.0 / ref_bytes;
+		samples[i].rel = (double)samples[i].cpu_ns / pixels /
+			MAX(ref, 1e-6);
+	}
+
+	/* the median is robust against both directions of noise */
+	qsort(samples, BENCH_SAMPLES, sizeof samples[0], bench_rel_cmp);
+	res->ref_per_pix = samples[BENCH_SAMPLES / 2].rel;
+
+	qsort(samples, BENCH_SAMPLES, sizeof samples[0], bench_sample_cmp);
+	med = samples[BENCH_SAMPLES / 2];
+
+	res->ns_per_pix     = (double)med.ns / pixels;
+	res->cycles_per_pix = env->cycles_fd < 0 ? -1 :
+		(double)med.cycles / pixels;
+	res->mb_per_s       = (double)pixels * fb->var.bits_per_pixel / 8 /
+		(med.ns / 1e9) / 1e6;
+}
+
+static int bench_cycles_open(void)
+{
+	struct perf_event_attr	attr = {
+		.type           = PERF_TYPE_HARDWARE,
+		.size           = sizeof attr,
+		.config         = PERF_COUNT_HW_CPU_CYCLES,
+		.exclude_kernel = 1,
+		.exclude_hv     = 1,
+	};
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static struct bench_result const *
+bench_find(struct bench_result const *res, size_t num,
+	   struct bench_result const *key)
+{
+	for (size_t i = 0; i < num; ++i) {
+		if (strcmp(res[i].mode, key->mode) == 0 &&
+		    strcmp(res[i].format, key->format) == 0 &&
+		    strcmp(res[i].geometry, key->geometry) == 0)
+			return &res[i];
+	}
+
+	return NULL;
+}
+
+static int baseline_read(char const *fname, struct bench_result **res,
+			 size_t *num)
+{
+	FILE		*f = fopen(fname, "re");
+	char		*line = NULL;
+	size_t		line_sz = 0;
+
+	*res = NULL;
+	*num = 0;
+
+	if (!f) {
+		fprintf(stderr, "Can not open baseline '%s': %m\n", fname);
+		return -1;
+	}
+
+	while (getline(&line, &line_sz, f) >= 0) {
+		struct bench_result	r;
+		char			cycles[32];
+		struct bench_result	*tmp;
+
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%15s %15s %15s %lf %31s", r.mode, r.format,
+			   r.geometry, &r.ref_per_pix, cycles) != 5)
+			continue;
+
+		r.cycles_per_pix = strcmp(cycles, "-") == 0 ? -1 : atof(cycles);
+
+		tmp = realloc(*res, (*num + 1) * sizeof **res);
+		if (!tmp)
+			break;
+
+		*res = tmp;
+		(*res)[(*num)++] = r;
+	}
+
+	free(line);
+	fclose(f);
+
+	return 0;
+}
+
+static void baseline_write_entry(FILE *f, struct bench_result const *r)
+{
+	fprintf(f, "%-8s %-14s %-10s %10.4f ", r->mode, r->format, r->geometry,
+		r->ref_per_pix);
+
+	if (r->cycles_per_pix < 0)
+		fprintf(f, "%10s\n", "-");
+	else
+		fprintf(f, "%10.3f\n", r->cycles_per_pix);
+}
+
+static int bench_result_cmp(void const *a_v, void const *b_v)
+{
+	struct bench_result const	*a = a_v;
+	struct bench_result const	*b = b_v;
+
+	if (a->cycles_per_pix > 0 && b->cycles_per_pix > 0)
+		return (a->cycles_per_pix < b->cycles_per_pix ? -1 :
+			a->cycles_per_pix > b->cycles_per_pix);
+
+	return a->ref_per_pix < b->ref_per_pix ? -1 :
+		a->ref_per_pix > b->ref_per_pix;
+}
+
+/* relative slowdown against the baseline; cycles are preferred because
+ * they do not depend on the cpu frequency */
+static double bench_ratio(struct bench_result const *r,
+			  struct bench_result const *base)
+{
+	if (base->cycles_per_pix > 0 && r->cycles_per_pix > 0)
+		return r->cycles_per_pix / base->cycles_per_pix;
+
+	return r->ref_per_pix / base->ref_per_pix;
+}
+
+static void bench_print(struct bench_result const *r, char const *cmp)
+{
+	printf("%-8s %-14s %-10s %10.4f %10.3f ", r->mode, r->format,
+	       r->geometry, r->ns_per_pix, r->ref_per_pix);
+	if (r->cycles_per_pix < 0)
+		printf("%10s", "-");
+	else
+		printf("%10.3f", r->cycles_per_pix);
+	printf(" %10.1f %s\n", r->mb_per_s, cmp);
+	fflush(stdout);
+}
+
+/* measures the entry again with a freshly allocated framebuffer */
+static int bench_again(struct bench_env const *env, struct bench_entry *e)
+{
+	struct bench_fb		fb;
+	struct bench_result	*r = &e->res[e->num_res];
+
+	if (bench_fb_init(&fb, &FORMATS[e->f], GEOMETRIES[e->g].xres,
+			  GEOMETRIES[e->g].yres) < 0)
+		return -1;
+
+	*r = e->res[0];
+	bench_one(env, &fb, e->m, r);
+	++e->num_res;
+
+	bench_fb_free(&fb);
+	return 0;
+}
+
+__attribute__((__noreturn__))
+static void bench_help(void)
+{
+	printf("Usage: fbbench [--baseline <fname> [--threshold <percent>]]\n"
+	       "               [--write-baseline <fname>] [--filter <substr>]\n");
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char const		*baseline = NULL;
+	char const		*write_baseline = NULL;
+	char const		*filter = NULL;
+	double			threshold = 25;
+	struct bench_result	*base_res = NULL;
+	size_t			base_num = 0;
+	FILE			*out = NULL;
+	struct bench_env	env;
+	unsigned int		num_regressions = 0;
+	struct bench_entry	*again = NULL;
+	size_t			num_again = 0;
+
+	while (1) {
+		int		c = getopt_long(argc, argv, "", BENCH_OPTIONS, 0);
+
+		if (c==-1)
+			break;
+
+		switch (c) {
+		case CMD_HELP:		bench_help();
+		case CMD_BASELINE:	baseline = optarg; break;
+		case CMD_WRITE_BASELINE: write_baseline = optarg; break;
+		case CMD_THRESHOLD:	threshold = atof(optarg); break;
+		case CMD_FILTER:	filter = optarg; break;
+		default:
+			fprintf(stderr, "invalid option; try '--help' for more information\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (baseline && baseline_read(baseline, &base_res, &base_num) < 0)
+		return EXIT_FAILURE;
+
+	if (write_baseline) {
+		out = fopen(write_baseline, "we");
+		if (!out) {
+			fprintf(stderr, "Can not create '%s': %m\n", write_baseline);
+			return EXIT_FAILURE;
+		}
+
+		fprintf(out, "# mode    format         geometry    ref/pixel cycles/pixel\n");
+	}
+
+	env.cycles_fd = bench_cycles_open();
+	env.null_fd   = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	if (env.null_fd < 0) {
+		perror("open(/dev/null)");
+		return EXIT_FAILURE;
+	}
+
+	if (bench_ref_init(&env) < 0)
+		return EXIT_FAILURE;
+
+	printf("# memcpy() reference: %.1f MB/s\n",
+	       (double)REF_SIZE * env.ref_loops /
+	       (bench_ref_measure(&env) / 1e9) / 1e6);
+
+	printf("%-8s %-14s %-10s %10s %10s %10s %10s %s\n", "mode", "format",
+	       "geometry", "ns/pix", "ref/pix", "cyc/pix", "MB/s", "baseline");
+
+	for (size_t g = 0; g < ARRAY_SIZE(GEOMETRIES); ++g) {
+		for (size_t f = 0; f < ARRAY_SIZE(FORMATS); ++f) {
+			struct bench_format const	*fmt = &FORMATS[f];
+			struct bench_fb			fb;
+			bool				have_fb = false;
+
+			for (size_t m = 0; m < ARRAY_SIZE(MODE_NAMES); ++m) {
+				struct bench_result		r;
+				struct bench_result const	*base;
+				char				cmp[32] = "";
+
+				if (!bench_supported(m, fmt))
+					continue;
+
+				snprintf(r.mode,     sizeof r.mode,     "%s", MODE_NAMES[m]);
+				snprintf(r.format,   sizeof r.format,   "%s", fmt->name);
+				snprintf(r.geometry, sizeof r.geometry, "%ux%u",
+					 GEOMETRIES[g].xres, GEOMETRIES[g].yres);
+
+				if (filter) {
+					char	key[64];
+
+					snprintf(key, sizeof key, "%s/%s/%s",
+						 r.mode, r.format, r.geometry);
+					if (!strstr(key, filter))
+						continue;
+				}
+
+				if (!have_fb) {
+					if (bench_fb_init(&fb, fmt, GEOMETRIES[g].xres,
+							  GEOMETRIES[g].yres) < 0)
+						return EXIT_FAILURE;
+					have_fb = true;
+				}
+
+				bench_one(&env, &fb, m, &r);
+
+				base = bench_find(base_res, base_num, &r);
+				if (base) {
+					double	ratio = bench_ratio(&r, base);
+
+					snprintf(cmp, sizeof cmp, "%+6.1f%%%s",
+						 (ratio - 1) * 100,
+						 ratio > 1 + threshold / 100 ?
+						 " (again)" : "");
+
+					if (ratio <= 1 + threshold / 100)
+						base = NULL;
+				}
+
+				bench_print(&r, cmp);
+
+				if (out || base) {
+					struct bench_entry	*tmp;
+
+					tmp = realloc(again, (num_again + 1) * sizeof again[0]);
+					if (!tmp) {
+						perror("realloc()");
+						return EXIT_FAILURE;
+					}
+
+					again = tmp;
+					again[num_again++] = (struct bench_entry) {
+						.g       = g,
+						.f       = f,
+						.m       = m,
+						.base    = base,
+						.res     = { r },
+						.num_res = 1,
+					};
+				}
+			}
+
+			if (have_fb)
+				bench_fb_free(&fb);
+		}
+	}
+
+	if (num_again > 0) {
+		printf("# measuring %zu results again\n", num_again);
+		fflush(stdout);
+	}
+
+	for (unsigned int i = 0; i < BENCH_RETRIES; ++i) {
+		for (size_t k = 0; k < num_again; ++k) {
+			struct bench_entry	*e = &again[k];
+
+			/* a regression needs to show up in every measurement */
+			if (e->base && bench_ratio(&e->res[e->num_res - 1],
+						   e->base) <= 1 + threshold / 100)
+				continue;
+
+			if (bench_again(&env, e) < 0)
+				return EXIT_FAILURE;
+		}
+	}
+
+	for (size_t k = 0; k < num_again; ++k) {
+		struct bench_entry	*e = &again[k];
+		struct bench_result	*r;
+		char			cmp[32] = "";
+
+		qsort(e->res, e->num_res, sizeof e->res[0], bench_result_cmp);
+
+		if (e->base) {
+			double	ratio;
+
+			r     = &e->res[0];
+			ratio = bench_ratio(r, e->base);
+
+			snprintf(cmp, sizeof cmp, "%+6.1f%%%s", (ratio - 1) * 100,
+				 ratio > 1 + threshold / 100 ? " REGRESSION" : "");
+
+			if (ratio > 1 + threshold / 100)
+				++num_regressions;
+		} else {
+			r = &e->res[e->num_res / 2];
+		}
+
+		bench_print(r, cmp);
+
+		if (out)
+			baseline_write_entry(out, r);
+	}
+
+	if (out)
+		fclose(out);
+
+	free(again);
+	free(base_res);
+	bench_ref_free(&env);
+
+	if (num_regressions > 0) {
+		fprintf(stderr, "%u results regressed by more than %.0f%%\n",
+			num_regressions, threshold);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,3679 @@
+/*	--*- c -*--
+ * Copyright (C) 2015 Enrico Scholz <enrico.scholz@sigma-chemnitz.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/fb.h>
+
+#if defined(__NR_io_uring_setup) && defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    define HAVE_IO_URING	1
+#  endif
+#endif
+
+#include "libfbtest.h"
+
+#define CROSS_SZ	50
+
+struct rgb_pix {
+	uint16_t	r;
+	uint16_t	g;
+	uint16_t	b;
+	uint16_t	_a;
+};
+
+static uint32_t ror32_8(uint32_t v)
+{
+	return ((v & 0xffu) << 24) | (v >> 8);
+}
+
+static uint32_t ror32_1(uint32_t v)
+{
+	return ((v & 0x1u) << 30) | (v >> 1);
+}
+
+/* first and last (exclusive) colormap entry used by the patterns */
+#define PAL_START	100u
+#define PAL_END		213u
+
+/* Loads the colormap for the 8 bpp patterns: color bands at 100, a grey
+ * ramp at 200 and white, black and the 'p' color at 210.  The entries
+ * are written with a single FBIOPUTCMAP over the whole range; entries in
+ * between keep their current value and the update is skipped when the
+ * colormap is already loaded. */
+static int initPalette(int fd, char const *pin_str, struct fb_var_screeninfo const *info)
+{
+	int const	pos[] = { 0,
+				  info->red.length+1,
+				  info->red.length + info->green.length+2,
+				  info->red.length + info->green.length + info->blue.length+3 };
+
+	int const	min_len = MIN(MIN(info->red.length, info->green.length),
+				      info->blue.length)+1;
+
+	unsigned int const	len = MAX(PAL_END, 200u + min_len) - PAL_START;
+
+	uint16_t	red[len];
+	uint16_t	green[len];
+	uint16_t	blue[len];
+	uint16_t	cur_red[len];
+	uint16_t	cur_green[len];
+	uint16_t	cur_blue[len];
+	int		i;
+	uint16_t	pin_val = pin_str ? atoi(pin_str) : 0;
+	uint16_t	*r, *g, *b;
+
+	struct fb_cmap	cmap = {
+		.start = PAL_START,
+		.len   = len,
+		.red   = red,
+		.green = green,
+		.blue  = blue,
+	};
+
+	struct fb_cmap	cur = {
+		.start = PAL_START,
+		.len   = len,
+		.red   = cur_red,
+		.green = cur_green,
+		.blue  = cur_blue,
+	};
+
+	bool const	have_cur = ioctl(fd, FBIOGETCMAP, &cur) == 0;
+
+	if (have_cur) {
+		memcpy(red,   cur_red,   sizeof red);
+		memcpy(green, cur_green, sizeof green);
+		memcpy(blue,  cur_blue,  sizeof blue);
+	} else {
+		memset(red,   0, sizeof red);
+		memset(green, 0, sizeof green);
+		memset(blue,  0, sizeof blue);
+	}
+
+	r = red   + 100 - PAL_START;
+	g = green + 100 - PAL_START;
+	b = blue  + 100 - PAL_START;
+
+	for (i=0; i<pos[3]; ++i) {
+		r[i] = g[i] = b[i] = 0;
+
+		if      (i>=pos[2]) b[i] = (1 << ((i-pos[2]) + (15-info->blue.length)));
+		else if (i>=pos[1]) g[i] = (1 << ((i-pos[1]) + (15-info->green.length)));
+		else                r[i] = (1 << ((i-pos[0]) + (15-info->red.length)));
+	}
+
+	r[pos[1]] = 0xffff;
+	g[pos[2]] = 0xffff;
+
+	r = red   + 200 - PAL_START;
+	g = green + 200 - PAL_START;
+	b = blue  + 200 - PAL_START;
+
+	for (i=0; i+1<min_len; ++i)
+		r[i] = g[i] = b[i] = (1 << (i+(16-min_len)));
+
+	r[min_len-1] = g[min_len-1] = b[min_len-1] = 0xffff;
+
+	r = red   + 210 - PAL_START;
+	g = green + 210 - PAL_START;
+	b = blue  + 210 - PAL_START;
+
+	r[0] = g[0] = b[0] = 0xffff;
+	r[1] = g[1] = b[1] = 0x0000;
+	r[2] = pin_str ? (pin_val & 0xfc0000) >> 8 : 0;
+	g[2] = pin_str ? (pin_val & 0x00fc00)      : 0;
+	b[2] = pin_str ? (pin_val & 0x0000fc) << 8 : 0;
+
+	if (have_cur &&
+	    memcmp(red,   cur_red,   sizeof red)   == 0 &&
+	    memcmp(green, cur_green, sizeof green) == 0 &&
+	    memcmp(blue,  cur_blue,  sizeof blue)  == 0)
+		return 0;
+
+	if (ioctl(fd, FBIOPUTCMAP, &cmap) < 0) {
+		perror("ioctl(FBIOPUTCMAP)");
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint32_t bitrev(uint32_t v, unsigned int len)
+{
+	uint32_t	res = 0;
+
+	while (len-- > 0) {
+		res = (res << 1) | (v & 1u);
+		v >>= 1;
+	}
+
+	return res;
+}
+
+/* places a channel value (already limited to the channel length) into
+ * its bitfield */
+static inline uint64_t chan_encode(uint32_t v, struct fb_bitfield const *f)
+{
+	if (f->msb_right)
+		v = bitrev(v, f->length);
+
+	return (uint64_t)v << f->offset;
+}
+
+static inline void *
+setPixelRGBRaw(void *buf_v, struct fb_var_screeninfo const *info, uint64_t val)
+{
+#define SET(TYPE)				\
+	case sizeof(TYPE)*8 : {			\
+		TYPE	*buf = buf_v;		\
+		*buf = val;			\
+		return buf+1;			\
+	}
+
+	switch (info->bits_per_pixel) {
+		SET(uint8_t);
+		SET(uint16_t);
+		SET(uint32_t);
+		SET(uint64_t);
+	case 24		: {
+		uint8_t	*buf = buf_v;
+		buf[0] = val       & 0xff;
+		buf[1] = (val>>8)  & 0xff;
+		buf[2] = (val>>16) & 0xff;
+		return buf+3;
+	}
+	case 48		: {
+		uint16_t *buf = buf_v;
+		buf[0] = val       & 0xffff;
+		buf[1] = (val>>16) & 0xffff;
+		buf[2] = (val>>32) & 0xffff;
+		return buf+3;
+	}
+	default		:
+		assert(0);
+	}
+#undef SET
+}
+
+static ptrdiff_t get_pix_ofs(unsigned int x, unsigned int y,
+			     struct fb_var_screeninfo const *info)
+{
+	return ((y * info->xres_virtual) + x) * info->bits_per_pixel / 8;
+}
+
+static size_t get_line_size(struct fb_var_screeninfo const *info)
+{
+	return ((size_t)info->xres_virtual * info->bits_per_pixel + 7) / 8;
+}
+
+static inline void *
+setPixelRGB(void *buf_v, struct fb_var_screeninfo const *info, uint8_t r, uint8_t g, uint8_t b)
+{
+#define S(VAR,FIELD)	chan_encode((VAR)==0 ? 0 :			\
+			  (VAR)<=info->FIELD.length ? (1u<<((VAR)-1)) : ((1u<<(info->FIELD.length)) - 1), \
+			  &info->FIELD)
+
+	uint64_t	val = S(r, red) | S(g, green) | S(b, blue);
+#undef S
+
+	return setPixelRGBRaw(buf_v, info, val);
+}
+
+static inline void *
+setPixelRGBCol(void *buf_v, struct fb_var_screeninfo const *info, uint16_t r, uint16_t g, uint16_t b)
+{
+#define S(VAR,FIELD)							\
+	chan_encode((VAR)>=(1u << info->FIELD.length) ? ((1u << info->FIELD.length) - 1u) : (VAR), \
+		    &info->FIELD)
+
+	uint64_t	val = S(r, red) | S(g, green) | S(b, blue);
+#undef S
+
+	return setPixelRGBRaw(buf_v, info, val);
+}
+
+static inline uint64_t load_pix(void const *buf_v, unsigned int bpp)
+{
+#define GET(TYPE)				\
+	case sizeof(TYPE)*8 : {			\
+		TYPE const	*buf = buf_v;	\
+		return *buf;			\
+	}
+
+	switch (bpp) {
+		GET(uint8_t);
+		GET(uint16_t);
+		GET(uint32_t);
+		GET(uint64_t);
+	case 24		: {
+		uint8_t const	*buf = buf_v;
+		return (buf[0] | (buf[1]<<8) | (buf[2]<<16));
+	}
+	case 48		: {
+		uint16_t const	*buf = buf_v;
+		return (buf[0] | ((uint64_t)buf[1]<<16) | ((uint64_t)buf[2]<<32));
+	}
+	default		:
+		assert(0);
+	}
+#undef GET
+}
+
+/* Packed formats with 1, 2 or 4 bpp carry grey levels.  As with the
+ * kernel's drawing helpers on little endian hosts, the leftmost pixel
+ * is stored in the least significant bits of a byte. */
+static bool is_packed_bpp(unsigned int bpp)
+{
+	return bpp == 1 || bpp == 2 || bpp == 4;
+}
+
+/* byte with all pixels set to 'level' */
+static uint8_t packed_level_byte(unsigned int level, unsigned int bpp)
+{
+	static uint8_t const	REPL[] = { [1] = 0xff, [2] = 0x55, [4] = 0x11 };
+
+	return (level & ((1u << bpp) - 1u)) * REPL[bpp];
+}
+
+static uint8_t packed_mask(unsigned int x0, unsigned int x1, unsigned int bpp)
+{
+	unsigned int	lo = (x0 * bpp) % 8;
+	unsigned int	hi = x1 * bpp - (x0 * bpp) / 8 * 8;
+
+	return ((hi >= 8 ? 0x100u : (1u << hi)) - (1u << lo)) & 0xff;
+}
+
+/* Sets the pixels [x0, x1) of a packed row to 'level'.  Only the bytes
+ * at the ends of the run are merged; the middle is filled with whole
+ * bytes. */
+static void packed_fill_run(uint8_t *row, unsigned int x0, unsigned int x1,
+			    unsigned int level, unsigned int bpp)
+{
+	unsigned int const	ppb = 8 / bpp;
+	uint8_t const		v = packed_level_byte(level, bpp);
+	unsigned int		b0, b1;
+
+	if (x0 >= x1)
+		return;
+
+	b0 = x0 / ppb;
+	b1 = (x1 - 1) / ppb;
+
+	if (b0 == b1) {
+		uint8_t	m = packed_mask(x0, x1, bpp);
+
+		row[b0] = (row[b0] & ~m) | (v & m);
+		return;
+	}
+
+	if (x0 % ppb) {
+		uint8_t	m = packed_mask(x0, (b0 + 1) * ppb, bpp);
+
+		row[b0] = (row[b0] & ~m) | (v & m);
+		++b0;
+	}
+
+	if (x1 % ppb) {
+		uint8_t	m = packed_mask(b1 * ppb, x1, bpp);
+
+		row[b1] = (row[b1] & ~m) | (v & m);
+		--b1;
+	}
+
+	if (b0 <= b1)
+		memset(row + b0, v, b1 - b0 + 1);
+}
+
+static void packed_set(uint8_t *row, unsigned int x, unsigned int level,
+		       unsigned int bpp)
+{
+	packed_fill_run(row, x, x + 1, level, bpp);
+}
+
+/* Each row consists of two bands with a single color index; they are
+ * written with memset() and only the corner markers are set per pixel. */
+static void
+displayPalette(struct fb_var_screeninfo const *info, void *buf_v)
+{
+	unsigned int const	xres = info->xres;
+	unsigned int const	yres = info->yres;
+	size_t const		line_size = get_line_size(info);
+
+	unsigned int const	l_len = info->red.length + info->green.length + info->blue.length+3;
+	unsigned int const	r_len = MIN(MIN(info->red.length, info->green.length),
+					    info->blue.length)+1;
+	unsigned int		i;
+
+	for (unsigned int y = 0; y < yres; ++y) {
+		uint8_t		*row = (uint8_t *)buf_v + y * line_size;
+		uint8_t		lcol = 100 + ((y*l_len)/yres);
+		uint8_t		rcol = 200 + ((y*r_len)/yres);
+
+		memset(row,          lcol, xres/2);
+		memset(row + xres/2, rcol, xres - xres/2);
+	}
+
+#define P(X,Y,COL)	(((uint8_t *)buf_v)[(Y) * line_size + (X)] = (COL))
+
+	for (i=0; i<5; ++i) {
+		uint8_t	col = (i%2) ? 211 : 210;
+
+		P(i, 0, col);
+		P(0, i, col);
+
+		P(xres-i-1, 0, col);
+		P(xres-1,   i, col);
+
+		P(i, yres-1,   col);
+		P(0, yres-i-1, col);
+
+		P(xres-i-1, yres-1, col);
+		P(xres-1,   yres-i-1, col);
+	}
+
+#undef P
+}
+
+/* Grey level variant of displayPalette() for packed formats.  Rows are
+ * composed in a template and copied as a whole into the framebuffer so
+ * that the (often slow) device memory is written with whole bytes only. */
+static void
+displayPacked(struct fb_var_screeninfo const *info, void *buf_v)
+{
+	unsigned int const	bpp  = info->bits_per_pixel;
+	unsigned int const	xres = info->xres;
+	unsigned int const	yres = info->yres;
+	unsigned int const	max  = (1u << bpp) - 1u;
+	size_t const		line_size = get_line_size(info);
+	size_t const		row_len   = (xres * bpp + 7) / 8;
+	uint8_t			row[row_len];
+	unsigned int		old_level = ~0u;
+	bool			row_dirty = true;
+
+	for (unsigned int y = 0; y < yres; ++y) {
+		unsigned int	level  = y * (max + 1) / yres;
+		bool		border = y < 5 || y + 5 >= yres;
+
+		if (level != old_level || border || row_dirty) {
+			memset(row, 0, row_len);
+			packed_fill_run(row, 0, xres / 2, level, bpp);
+			packed_fill_run(row, xres / 2, xres, max - level, bpp);
+
+			old_level = level;
+			row_dirty = false;
+		}
+
+		if (border) {
+			unsigned int	i = y < 5 ? y : yres - y - 1;
+
+			if (i == 0) {
+				for (i = 0; i < 5 && i < xres; ++i) {
+					packed_set(row, i, i % 2 ? 0 : max, bpp);
+					packed_set(row, xres - i - 1, i % 2 ? 0 : max, bpp);
+				}
+			} else {
+				packed_set(row, 0, i % 2 ? 0 : max, bpp);
+				packed_set(row, xres - 1, i % 2 ? 0 : max, bpp);
+			}
+
+			row_dirty = true;
+		}
+
+		memcpy((uint8_t *)buf_v + y * line_size, row, row_len);
+	}
+}
+
+static void *
+draw_cross_rgb(void *ptr, struct fb_var_screeninfo const *info, int x, int y)
+{
+	int		is_black = 1;
+	uint8_t		col;
+
+	if (x == y || x == -y ||
+	    x == -CROSS_SZ+5 || x+1 == CROSS_SZ-5 ||
+	    y == -CROSS_SZ+5 || y+1 == CROSS_SZ-5)
+		is_black = !is_black;
+
+	if (y < 0)
+		is_black = !is_black;
+
+	col = is_black ? 0 : 255;
+	return setPixelRGB(ptr, info,   col,  col, col);
+}
+
+static void
+displayRGB(struct fb_var_screeninfo const *info, void *buf_v)
+{
+	int		x=0,y;
+	uint8_t	*ptr = buf_v;
+
+	int const	xres = info->xres;
+	int const	yres = info->yres;
+	int const	pos[] = { 0,
+				  info->red.length+1,
+				  info->red.length + info->green.length+2,
+				  info->red.length + info->green.length + info->blue.length+3 };
+	int const	min_len = MIN(MIN(info->red.length, info->green.length),
+				      info->blue.length)+1;
+	int		old_pos = -1;
+
+	for (y=0; y<yres; ++y) {
+		int		cur_pos	= (y*pos[3])/yres;
+
+		uint8_t	r = (pos[0]<=cur_pos && cur_pos<pos[1]) ? cur_pos-pos[0]+1 : 0;
+		uint8_t	g = (pos[1]<=cur_pos && cur_pos<pos[2]) ? cur_pos-pos[1]+1 : 0;
+		uint8_t	b = (pos[2]<=cur_pos && cur_pos<pos[3]) ? cur_pos-pos[2]+1 : 0;
+		uint8_t	grey = (min_len+1) * y/yres + 1;
+		int		max_x = xres;
+
+		if (y==0 || y+1==yres) {
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			ptr = setPixelRGB(ptr, info,   0,   0,   0);
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			ptr = setPixelRGB(ptr, info,   0,   0,   0);
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			x      = 5;
+			max_x -= x;
+		}
+		else if (y<5 || y+5>=yres) {
+			int	col = ((y<yres/2 && y%2) || (y>yres/2 && (yres-y-1)%2)) ? 0 : 255;
+			ptr    = setPixelRGB(ptr, info,  col, col, col);
+			x      = 1;
+			max_x -= x;
+		}
+		else if (cur_pos!=old_pos &&
+			 (cur_pos==pos[0] || cur_pos==pos[1] || cur_pos==pos[2] || cur_pos==pos[3])) {
+			ptr = setPixelRGB(ptr, info, 127, 127, 127);
+			ptr = setPixelRGB(ptr, info, 127, 127, 127);
+			x      = 2;
+		}
+		else
+			x      = 0;
+
+		for (; x<max_x; ++x) {
+			if (y >= yres/2 - CROSS_SZ && y < yres/2 + CROSS_SZ &&
+			    x >= xres/2 - CROSS_SZ && x < xres/2 + CROSS_SZ)
+				ptr = draw_cross_rgb(ptr, info, xres/2 - x, yres/2 - y);
+			else if (y < 4 && x == 4-y)
+				ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			else if (x<xres/2) ptr = setPixelRGB(ptr, info, r, g, b);
+			else if (grey>min_len) ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			else          ptr = setPixelRGB(ptr, info,
+							grey + info->red.length   - min_len,
+							grey + info->green.length - min_len,
+							grey + info->blue.length  - min_len);
+		}
+
+		if (y==0 || y+1==yres) {
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			ptr = setPixelRGB(ptr, info,   0,   0,   0);
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+			ptr = setPixelRGB(ptr, info,   0,   0,   0);
+			ptr = setPixelRGB(ptr, info, 255, 255, 255);
+		}
+		else if (y<5 || y+5>=yres) {
+			int	col = ((y<yres/2 && y%2) || (y>yres/2 && (yres-y-1)%2)) ? 0 : 255;
+			ptr    = setPixelRGB(ptr, info,  col, col, col);
+		}
+
+		ptr += ((info->xres_virtual - info->xres) *
+			(info->bits_per_pixel / 8));
+
+		old_pos = cur_pos;
+	}
+}
+
+/* writes the whole buffer; returns -1 with errno set on errors */
+static int write_all(int fd, void const *buf, size_t len)
+{
+	char const	*ptr  = buf;
+	while (len>0) {
+		ssize_t	l = write(fd, ptr, len);
+		if (l==0) {
+			errno = EIO;
+			perror("write()");
+			return -1;
+		} else if (l>0) {
+			ptr += l;
+			len -= l;
+		} else if (errno != EINTR) {
+			perror("write()");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+struct fbinfo {
+	struct fb_var_screeninfo	var;
+	int				fd;
+	void				*buf;
+	size_t				buf_size;
+	size_t				stride;
+
+	/* mapping of a raw dump; 'buf' points behind its header */
+	void				*map;
+	size_t				map_size;
+};
+
+struct window {
+	unsigned int			left;
+	unsigned int			right;
+	unsigned int			top;
+	unsigned int			bottom;
+};
+
+#define RAW_MAGIC	"FBTRAW01"
+
+/* Header of a --grab-raw dump.  It is followed by 'rows' lines of
+ * 'stride' bytes each in native pixel format and native byte order. */
+struct raw_header {
+	char				magic[8];
+	uint32_t			hdr_size;
+	uint32_t			stride;
+	uint32_t			rows;
+	uint32_t			_pad;
+	struct fb_var_screeninfo	var;
+};
+
+static bool raw_bpp_supported(unsigned int bpp)
+{
+	switch (bpp) {
+	case 1: case 2: case 4: case 8:
+	case 16: case 24: case 32: case 48: case 64:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static int fb_init_raw(struct fbinfo *info, size_t file_size)
+{
+	struct raw_header const	*hdr;
+
+	if (file_size < sizeof *hdr) {
+		fprintf(stderr, "raw dump too small\n");
+		return -1;
+	}
+
+	/* private mapping so that drawing into a dump does not modify it */
+	info->map_size = file_size;
+	info->map      = mmap(0, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			      info->fd, 0);
+	if (info->map == MAP_FAILED) {
+		perror("mmap(<raw>)");
+		info->map = NULL;
+		return -1;
+	}
+
+	hdr = info->map;
+	if (hdr->hdr_size < sizeof *hdr || hdr->hdr_size > file_size ||
+	    !raw_bpp_supported(hdr->var.bits_per_pixel) ||
+	    hdr->var.xres == 0 || hdr->var.yres == 0 || hdr->stride == 0 ||
+	    hdr->var.xres_virtual < hdr->var.xres ||
+	    hdr->rows < hdr->var.yres ||
+	    hdr->stride < get_line_size(&hdr->var) ||
+	    (file_size - hdr->hdr_size) / hdr->stride < hdr->rows) {
+		fprintf(stderr, "corrupted raw dump\n");
+		munmap(info->map, info->map_size);
+		info->map = NULL;
+		return -1;
+	}
+
+	info->var              = hdr->var;
+	info->var.yres_virtual = hdr->rows;
+	info->var.yoffset      = 0;
+	info->stride           = hdr->stride;
+	info->buf              = (char *)info->map + hdr->hdr_size;
+	info->buf_size         = (size_t)hdr->stride * hdr->rows;
+
+	return 0;
+}
+
+static bool fb_is_raw(int fd, size_t *file_size)
+{
+	struct stat	st;
+	char		magic[sizeof RAW_MAGIC - 1];
+
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	if (pread(fd, magic, sizeof magic, 0) != sizeof magic ||
+	    memcmp(magic, RAW_MAGIC, sizeof magic) != 0)
+		return false;
+
+	*file_size = st.st_size;
+	return true;
+}
+
+static int fb_init(char const *fbdev, struct fbinfo *info)
+{
+	size_t		raw_size;
+
+	memset(info, 0, sizeof *info);
+
+	info->fd = open(fbdev, O_RDWR);
+	if (info->fd<0)
+		/* raw dumps might be read-only */
+		info->fd = open(fbdev, O_RDONLY);
+
+	if (info->fd<0) {
+		perror("open(<fbdev>)");
+		return -1;
+	}
+
+	if (fb_is_raw(info->fd, &raw_size)) {
+		if (fb_init_raw(info, raw_size) < 0)
+			goto err;
+
+		return 0;
+	}
+
+	if (ioctl(info->fd, FBIOGET_VSCREENINFO, &info->var)<0) {
+		perror("ioctl(FBIOGET_VSCREENINFO)");
+		goto err;
+		return -1;
+	}
+
+	{
+		size_t const	line_size   = get_line_size(&info->var);
+
+		info->stride   = line_size;
+		info->buf_size = line_size * info->var.yres_virtual;
+		info->buf      = mmap(0, info->buf_size,
+				      PROT_READ | PROT_WRITE, MAP_SHARED,
+				      info->fd, 0);
+
+		if (info->buf == MAP_FAILED) {
+			perror("mmap()");
+			info->buf = NULL;
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	if (info->buf)
+		munmap(info->buf, info->buf_size);
+	close(info->fd);
+	return -1;
+}
+
+/* raw dumps and attached buffers have no colormap */
+static bool fb_has_cmap(struct fbinfo const *fb)
+{
+	return fb->fd >= 0 && !fb->map;
+}
+
+static void fb_free(struct fbinfo *info)
+{
+	if (info->map)
+		munmap(info->map, info->map_size);
+	else
+		munmap(info->buf, info->buf_size);
+	close(info->fd);
+}
+
+/* edge length (in pixels) of the blocks used for 90/270 degree copies;
+ * a source and a destination block fit into the L1 cache */
+#define ROT_TILE	32
+
+typedef struct { uint8_t v[3]; }	pix24_t;
+typedef struct { uint8_t v[6]; }	pix48_t;
+
+/* Copies a w x h image from 'src' to 'dst' rotated by 'rot' (one of
+ * FB_ROTATE_*).  For FB_ROTATE_CW, the source pixel (x,y) ends up at
+ * (h-1-y, x); FB_ROTATE_CCW is the inverse. */
+#define DEFINE_ROT_COPY(NAME, TYPE)					\
+static void rot_copy_##NAME(void *dst, size_t dst_stride,		\
+			    void const *src, size_t src_stride,	\
+			    unsigned int w, unsigned int h,		\
+			    unsigned int rot)				\
+{									\
+	for (unsigned int ty = 0; ty < h; ty += ROT_TILE) {		\
+		unsigned int	y1 = MIN(ty + ROT_TILE, h);		\
+									\
+		for (unsigned int tx = 0; tx < w; tx += ROT_TILE) {	\
+			unsigned int	x1 = MIN(tx + ROT_TILE, w);	\
+									\
+			for (unsigned int y = ty; y < y1; ++y) {	\
+				TYPE const	*s = (TYPE const *)	\
+					((char const *)src + y * src_stride) + tx; \
+									\
+				for (unsigned int x = tx; x < x1; ++x) { \
+					unsigned int	dx, dy;		\
+									\
+					if (rot == FB_ROTATE_CW) {	\
+						dx = h - 1 - y;		\
+						dy = x;			\
+					} else {			\
+						dx = y;			\
+						dy = w - 1 - x;		\
+					}				\
+									\
+					((TYPE *)((char *)dst + dy * dst_stride))[dx] = *s++; \
+				}					\
+			}						\
+		}							\
+	}								\
+}
+
+DEFINE_ROT_COPY(8,  uint8_t)
+DEFINE_ROT_COPY(16, uint16_t)
+DEFINE_ROT_COPY(24, pix24_t)
+DEFINE_ROT_COPY(32, uint32_t)
+DEFINE_ROT_COPY(48, pix48_t)
+DEFINE_ROT_COPY(64, uint64_t)
+
+#undef DEFINE_ROT_COPY
+
+static void rot_copy(void *dst, size_t dst_stride,
+		     void const *src, size_t src_stride,
+		     unsigned int w, unsigned int h, unsigned int bpp,
+		     unsigned int rot)
+{
+	size_t const	row_len = (size_t)w * bpp / 8;
+
+	switch (rot) {
+	case FB_ROTATE_UR:
+		for (unsigned int y = 0; y < h; ++y)
+			memcpy((char *)dst + y * dst_stride,
+			       (char const *)src + y * src_stride, row_len);
+		return;
+
+	case FB_ROTATE_UD:
+		/* rotating by 180 degrees is a horizontal and a vertical
+		 * mirror; both sides are accessed row by row */
+		for (unsigned int y = 0; y < h; ++y) {
+			char const	*s = (char const *)src + y * src_stride;
+			char		*d = ((char *)dst + (h - 1 - y) * dst_stride +
+					      row_len);
+
+			for (unsigned int x = 0; x < w; ++x) {
+				d -= bpp / 8;
+				memcpy(d, s, bpp / 8);
+				s += bpp / 8;
+			}
+		}
+		return;
+	}
+
+#define ROT(BPP)						\
+	case BPP:						\
+		rot_copy_##BPP(dst, dst_stride, src, src_stride, w, h, rot); \
+		break
+
+	switch (bpp) {
+		ROT(8);
+		ROT(16);
+		ROT(24);
+		ROT(32);
+		ROT(48);
+		ROT(64);
+	default:
+		assert(0);
+	}
+#undef ROT
+}
+
+static unsigned int rot_inverse(unsigned int rot)
+{
+	switch (rot) {
+	case FB_ROTATE_CW:	return FB_ROTATE_CCW;
+	case FB_ROTATE_CCW:	return FB_ROTATE_CW;
+	default:		return rot;
+	}
+}
+
+/* 'rotate' is the value of --rotate in degrees or -1 to use the one
+ * reported by the driver */
+static unsigned int fb_rotation(struct fbinfo const *fb, int rotate)
+{
+	if (rotate < 0)
+		return fb->var.rotate & 3;
+
+	return (rotate / 90) & 3;
+}
+
+/* size of the shadow buffer for fb_rot_view() */
+static size_t fb_rot_shadow_size(struct fbinfo const *fb)
+{
+	return ((size_t)fb->var.xres * fb->var.bits_per_pixel + 7) / 8 * fb->var.yres;
+}
+
+/* Prepares a view of the screen in its upright orientation.  Without
+ * rotation the view is the framebuffer itself; otherwise it is the
+ * 'shadow' buffer which is filled from the screen when 'load' is set and
+ * must be written back with fb_rot_commit(). */
+static int fb_rot_view(struct fbinfo const *fb, unsigned int rot,
+		       void *shadow, struct fbinfo *view, bool load)
+{
+	*view = *fb;
+
+	if (rot == FB_ROTATE_UR)
+		return 0;
+
+	if (is_packed_bpp(fb->var.bits_per_pixel)) {
+		fprintf(stderr, "Rotation not supported with %ubpp\n",
+			fb->var.bits_per_pixel);
+		return -1;
+	}
+
+	if (rot == FB_ROTATE_CW || rot == FB_ROTATE_CCW) {
+		view->var.xres = fb->var.yres;
+		view->var.yres = fb->var.xres;
+	}
+
+	view->var.xres_virtual = view->var.xres;
+	view->var.yres_virtual = view->var.yres;
+	view->var.xoffset      = 0;
+	view->var.yoffset      = 0;
+	view->var.rotate       = FB_ROTATE_UR;
+	view->stride           = get_line_size(&view->var);
+	view->buf_size         = view->stride * view->var.yres;
+	view->map              = NULL;
+	view->buf              = shadow;
+
+	assert(shadow != NULL);
+
+	if (load)
+		rot_copy(view->buf, view->stride, fb->buf, fb->stride,
+			 fb->var.xres, fb->var.yres, fb->var.bits_per_pixel,
+			 rot_inverse(rot));
+
+	return 0;
+}
+
+static void fb_rot_commit(struct fbinfo *fb, unsigned int rot,
+			  struct fbinfo const *view)
+{
+	if (rot == FB_ROTATE_UR)
+		return;
+
+	rot_copy(fb->buf, fb->stride, view->buf, view->stride,
+		 view->var.xres, view->var.yres, fb->var.bits_per_pixel, rot);
+}
+
+/* bump this when the output of a cached renderer changes */
+#define CACHE_VERSION	3
+
+/* Rendered patterns depend only on the screen geometry and the pixel
+ * layout; the key encodes all of them so that a cached frame can be
+ * copied into the framebuffer without any further checks. */
+static int cache_fname(char *res, size_t res_len, char const *dir,
+		       char const *pattern, struct fbinfo const *fb,
+		       unsigned int rot)
+{
+	struct fb_var_screeninfo const	*var = &fb->var;
+	int				l;
+
+#define F(_f)	var->_f.offset, var->_f.length, var->_f.msb_right
+	l = snprintf(res, res_len, "%s/%s-v%u-%ux%u-%ubpp-%zu-r%u.%u.%u-g%u.%u.%u-b%u.%u.%u-t%u.%u.%u-rot%u.fb",
+		     dir, pattern, CACHE_VERSION,
+		     var->xres, var->yres, var->bits_per_pixel, fb->stride,
+		     F(red), F(green), F(blue), F(transp), rot);
+#undef F
+
+	return l < 0 || (size_t)l >= res_len ? -1 : 0;
+}
+
+static void cache_copy_rows(void *dst, void const *src, struct fbinfo const *fb)
+{
+	size_t const	row_len = ((size_t)fb->var.xres * fb->var.bits_per_pixel + 7) / 8;
+	unsigned int	y;
+
+	if (row_len == fb->stride) {
+		memcpy(dst, src, fb->stride * fb->var.yres);
+		return;
+	}
+
+	for (y = 0; y < fb->var.yres; ++y)
+		memcpy((char *)dst + y * fb->stride,
+		       (char const *)src + y * fb->stride, row_len);
+}
+
+static int cache_load(char const *fname, struct fbinfo *fb)
+{
+	size_t const	size = fb->stride * fb->var.yres;
+	int		fd;
+	struct stat	st;
+	void		*map;
+
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	cache_copy_rows(fb->buf, map, fb);
+	munmap(map, size);
+
+	return 0;
+}
+
+static int cache_store(char const *fname, struct fbinfo const *fb)
+{
+	size_t const	size = fb->stride * fb->var.yres;
+	char		tmp_fname[strlen(fname) + sizeof ".XXXXXX"];
+	int		fd;
+	void		*map;
+
+	strcpy(tmp_fname, fname);
+	strcat(tmp_fname, ".XXXXXX");
+
+	fd = mkstemp(tmp_fname);
+	if (fd < 0) {
+		perror("mkstemp(<cache>)");
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate(<cache>)");
+		goto err;
+	}
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap(<cache>)");
+		goto err;
+	}
+
+	memcpy(map, fb->buf, size);
+	munmap(map, size);
+
+	/* make sure that a power loss can not leave a truncated frame
+	 * behind the final name */
+	if (fdatasync(fd) < 0 || fchmod(fd, 0644) < 0) {
+		perror("fdatasync(<cache>)");
+		goto err;
+	}
+
+	if (rename(tmp_fname, fname) < 0) {
+		perror("rename(<cache>)");
+		goto err;
+	}
+
+	close(fd);
+	return 0;
+
+err:
+	unlink(tmp_fname);
+	close(fd);
+	return -1;
+}
+
+/* returns 1 when the pattern was loaded from the cache */
+static int render_cached(struct fbinfo *fb, char const *cache_dir,
+			 char const *pattern, unsigned int rot, void *shadow,
+			 void (*render)(struct fbinfo *fb))
+{
+	char	fname[PATH_MAX];
+	bool	use_cache;
+	int	rc = 0;
+
+	use_cache = (cache_dir &&
+		     cache_fname(fname, sizeof fname, cache_dir, pattern,
+				 fb, rot) == 0);
+
+	if (use_cache && cache_load(fname, fb) == 0) {
+		rc = 1;
+	} else {
+		struct fbinfo	view;
+
+		rc = fb_rot_view(fb, rot, shadow, &view, false);
+		if (rc == 0) {
+			render(&view);
+			fb_rot_commit(fb, rot, &view);
+
+			if (use_cache)
+				cache_store(fname, fb);
+		}
+	}
+
+	return rc;
+}
+
+struct chan_conv {
+	unsigned int		shift;
+	unsigned int		length;
+	uint32_t		mask;
+	bool			msb_right;
+};
+
+struct pix_conv;
+typedef void (*conv_row_fn)(void *dst, void const *src, unsigned int cnt,
+			    struct pix_conv const *conv);
+
+/* converts native pixels into PPM samples; channels with up to 8 bits
+ * are converted to RGB888, deeper ones to big endian RGB161616 */
+struct pix_conv {
+	struct chan_conv	chan[3];
+	unsigned int		bpp;
+	unsigned int		maxval;
+	unsigned int		out_bpp;
+	conv_row_fn		row;
+
+	/* grey values of the pixels of each byte in packed formats */
+	uint8_t			unpack[256][8];
+};
+
+static uint32_t chan_decode(uint64_t v, struct chan_conv const *c)
+{
+	uint32_t	res = (v >> c->shift) & c->mask;
+
+	if (c->msb_right)
+		res = bitrev(res, c->length);
+
+	return res;
+}
+
+static unsigned char normalize_rgb(uint64_t v, struct chan_conv const *c)
+{
+	uint32_t	res = chan_decode(v, c);
+
+	if (c->length > 8)
+		return res >> (c->length - 8);
+	else
+		return res << (8 - c->length);
+}
+
+static uint16_t normalize_rgb16(uint64_t v, struct chan_conv const *c)
+{
+	uint32_t	res = chan_decode(v, c);
+	unsigned int	len = c->length;
+
+	if (len == 0)
+		return 0;
+
+	/* replicate the bits so that a full channel maps to 0xffff */
+	while (len < 16) {
+		res = (res << len) | res;
+		len *= 2;
+	}
+
+	return res >> (len - 16);
+}
+
+static void conv_row_rgb8(void *dst, void const *src, unsigned int cnt,
+			  struct pix_conv const *conv)
+{
+	uint8_t		*out = dst;
+	uint8_t const	*in  = src;
+	unsigned int	Bpp  = conv->bpp / 8;
+
+	while (cnt-- > 0) {
+		uint64_t	v = load_pix(in, conv->bpp);
+
+		*out++ = normalize_rgb(v, &conv->chan[0]);
+		*out++ = normalize_rgb(v, &conv->chan[1]);
+		*out++ = normalize_rgb(v, &conv->chan[2]);
+		in += Bpp;
+	}
+}
+
+static void conv_row_rgb16(void *dst, void const *src, unsigned int cnt,
+			   struct pix_conv const *conv)
+{
+	uint8_t		*out = dst;
+	uint8_t const	*in  = src;
+	unsigned int	Bpp  = conv->bpp / 8;
+
+	while (cnt-- > 0) {
+		uint64_t	v = load_pix(in, conv->bpp);
+
+		for (unsigned int i = 0; i < 3; ++i) {
+			uint16_t	c = normalize_rgb16(v, &conv->chan[i]);
+
+			*out++ = c >> 8;
+			*out++ = c & 0xff;
+		}
+		in += Bpp;
+	}
+}
+
+/* fast path for the common 32bpp formats with 10 bit channels
+ * (ARGB2101010, ABGR2101010 and friends) */
+static void conv_row_x2101010(void *dst, void const *src, unsigned int cnt,
+			      struct pix_conv const *conv)
+{
+	uint8_t		*out = dst;
+	uint32_t const	*in  = src;
+	unsigned int	r_shift = conv->chan[0].shift;
+	unsigned int	g_shift = conv->chan[1].shift;
+	unsigned int	b_shift = conv->chan[2].shift;
+
+	while (cnt-- > 0) {
+		uint32_t	v = *in++;
+		uint32_t	r = (v >> r_shift) & 0x3ff;
+		uint32_t	g = (v >> g_shift) & 0x3ff;
+		uint32_t	b = (v >> b_shift) & 0x3ff;
+
+		r = (r << 6) | (r >> 4);
+		g = (g << 6) | (g >> 4);
+		b = (b << 6) | (b >> 4);
+
+		out[0] = r >> 8;
+		out[1] = r;
+		out[2] = g >> 8;
+		out[3] = g;
+		out[4] = b >> 8;
+		out[5] = b;
+		out += 6;
+	}
+}
+
+/* expands packed grey levels into RGB samples through 'unpack' */
+static void conv_row_packed(void *dst, void const *src, unsigned int cnt,
+			    struct pix_conv const *conv)
+{
+	unsigned int const	ppb = 8 / conv->bpp;
+	uint8_t			*out = dst;
+	uint8_t const		*in  = src;
+
+	for (; cnt >= ppb; cnt -= ppb) {
+		uint8_t const	*pix = conv->unpack[*in++];
+
+		for (unsigned int i = 0; i < ppb; ++i) {
+			out[0] = out[1] = out[2] = pix[i];
+			out += 3;
+		}
+	}
+
+	if (cnt > 0) {
+		uint8_t const	*pix = conv->unpack[*in];
+
+		for (unsigned int i = 0; i < cnt; ++i) {
+			out[0] = out[1] = out[2] = pix[i];
+			out += 3;
+		}
+	}
+}
+
+static void pix_conv_init_packed(struct pix_conv *conv, unsigned int bpp)
+{
+	unsigned int const	max = (1u << bpp) - 1u;
+
+	for (unsigned int b = 0; b < 256; ++b) {
+		for (unsigned int i = 0; i < 8 / bpp; ++i)
+			conv->unpack[b][i] = ((b >> (i * bpp)) & max) * 255 / max;
+	}
+
+	conv->bpp     = bpp;
+	conv->maxval  = 255;
+	conv->out_bpp = 3;
+	conv->row     = conv_row_packed;
+}
+
+/* 'max_bits' selects whether deep channels are converted to 16 bit
+ * samples or reduced to 8 bit ones */
+static void pix_conv_init(struct pix_conv *conv,
+			  struct fb_var_screeninfo const *var,
+			  unsigned int max_bits)
+{
+	struct fb_bitfield const	*fields[] = {
+		&var->red, &var->green, &var->blue
+	};
+	unsigned int			max_len = 0;
+	bool				is_2101010;
+
+	if (is_packed_bpp(var->bits_per_pixel)) {
+		pix_conv_init_packed(conv, var->bits_per_pixel);
+		return;
+	}
+
+	conv->bpp = var->bits_per_pixel;
+	is_2101010 = conv->bpp == 32;
+
+	for (unsigned int i = 0; i < 3; ++i) {
+		struct chan_conv	*c = &conv->chan[i];
+
+		c->shift     = fields[i]->offset;
+		c->length    = MIN(fields[i]->length, 16u);
+		c->mask      = (1u << c->length) - 1u;
+		c->msb_right = fields[i]->msb_right;
+
+		max_len    = MAX(max_len, c->length);
+		is_2101010 = is_2101010 && c->length == 10 && !c->msb_right;
+	}
+
+	if (max_len <= 8 || max_bits <= 8) {
+		conv->maxval  = 255;
+		conv->out_bpp = 3;
+		conv->row     = conv_row_rgb8;
+	} else {
+		conv->maxval  = 65535;
+		conv->out_bpp = 6;
+		conv->row     = is_2101010 ? conv_row_x2101010 : conv_row_rgb16;
+	}
+}
+
+/* converts the visible rows [y0, y1) into rows of PPM samples */
+static void grab_rows(struct fbinfo const *fb, struct pix_conv const *conv,
+		      unsigned int y0, unsigned int y1, uint8_t *dst)
+{
+	size_t const	row_len = (size_t)fb->var.xres * conv->out_bpp;
+
+	for (unsigned int y=y0; y<y1; ++y) {
+		conv->row(dst, fb->buf + y * fb->stride, fb->var.xres, conv);
+		dst += row_len;
+	}
+}
+
+/* chunk size for the write() fallback; keeps the writes large and
+ * page aligned relative to the start of the framebuffer */
+#define RAW_WRITE_CHUNK	(1u << 20)
+
+static size_t raw_write_vmsplice(int fd, void const *buf, size_t len)
+{
+	struct iovec	iov = {
+		.iov_base = (void *)buf,
+		.iov_len  = len,
+	};
+	size_t		done = 0;
+
+	while (iov.iov_len > 0) {
+		ssize_t	l = vmsplice(fd, &iov, 1, 0);
+
+		if (l <= 0)
+			break;
+
+		iov.iov_base  = (char *)iov.iov_base + l;
+		iov.iov_len  -= l;
+		done         += l;
+	}
+
+	return done;
+}
+
+/* Moves the data through a private pipe.  Every step must fit into the
+ * pipe as a whole because its only reader is this thread: a step covers
+ * at most as many pages as the pipe has slots, taking the offset into
+ * the first page into account. */
+static size_t raw_write_splice(int fd, void const *buf, size_t len)
+{
+	size_t const	page_size = sysconf(_SC_PAGESIZE);
+	int		pfd[2];
+	int		cap;
+	size_t		done = 0;
+
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+		return 0;
+
+	fcntl(pfd[1], F_SETPIPE_SZ, RAW_WRITE_CHUNK);
+
+	cap = fcntl(pfd[1], F_GETPIPE_SZ);
+	if (cap < (int)page_size)
+		goto out;
+
+	while (done < len) {
+		char const	*ptr = (char const *)buf + done;
+		size_t		ofs  = (uintptr_t)ptr % page_size;
+		struct iovec	iov = {
+			.iov_base = (void *)ptr,
+			.iov_len  = MIN(len - done, (size_t)cap - ofs),
+		};
+		ssize_t		in_pipe;
+
+		/* SPLICE_F_NONBLOCK as a safety net; a partial transfer is
+		 * drained and continued with the next step */
+		in_pipe = vmsplice(pfd[1], &iov, 1, SPLICE_F_NONBLOCK);
+		if (in_pipe <= 0)
+			break;
+
+		while (in_pipe > 0) {
+			ssize_t	l = splice(pfd[0], NULL, fd, NULL, in_pipe,
+					   SPLICE_F_MOVE);
+
+			if (l <= 0)
+				goto out;
+
+			in_pipe -= l;
+			done    += l;
+		}
+	}
+
+out:
+	close(pfd[0]);
+	close(pfd[1]);
+	return done;
+}
+
+/* Writes the framebuffer content without copying it through an
+ * intermediate buffer.  For pipes, vmsplice() hands the mapped pages to
+ * the reader directly so it sees them as they are when it consumes the
+ * data.  Framebuffer memory is often a PFN mapping which can not be
+ * spliced; the remaining data is written with large write()s then. */
+static int raw_write_rows(int fd, void const *buf, size_t len)
+{
+	struct stat	st;
+	size_t		done = 0;
+
+	if (fstat(fd, &st) == 0) {
+		if (S_ISFIFO(st.st_mode))
+			done = raw_write_vmsplice(fd, buf, len);
+		else if (S_ISREG(st.st_mode))
+			done = raw_write_splice(fd, buf, len);
+	}
+
+	while (done < len) {
+		size_t	l = MIN(len - done, RAW_WRITE_CHUNK);
+
+		if (write_all(fd, (char const *)buf + done, l) < 0)
+			return -1;
+
+		done += l;
+	}
+
+	return 0;
+}
+
+/* Dumps the visible rows, starting at the panned 'yoffset'.  The header
+ * keeps the original screen information including the offsets. */
+static int grab_raw(struct fbinfo const *fb, int out_fd)
+{
+	unsigned int const	y0 = (fb->var.yres_virtual > fb->var.yres ?
+				      MIN(fb->var.yoffset,
+					  fb->var.yres_virtual - fb->var.yres) :
+				      0);
+	struct raw_header	hdr;
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, RAW_MAGIC, sizeof hdr.magic);
+	hdr.hdr_size = sizeof hdr;
+	hdr.stride   = fb->stride;
+	hdr.rows     = fb->var.yres;
+	hdr.var      = fb->var;
+
+	if (write_all(out_fd, &hdr, sizeof hdr) < 0)
+		return -1;
+
+	return raw_write_rows(out_fd, (char const *)fb->buf + y0 * fb->stride,
+			      fb->stride * fb->var.yres);
+}
+
+/* Output of a stream to several file descriptors.  The producer fills
+ * chunks of which OUT_DEPTH can be in flight; every sink receives them
+ * in order.  The chunks are written with io_uring when the kernel
+ * supports it and by a writer thread otherwise.  A failing sink is
+ * dropped while the others continue.
+ *
+ * The queue belongs to a context and is set up by its first use; the
+ * buffers, the ring or the thread are reused by later streams. */
+#define OUT_DEPTH	4
+#define OUT_CHUNK	(256u << 10)
+
+/* room for the PPM header in the first chunk of fbt_grab_write() */
+#define PPM_HDR_MAX	32
+
+/* size of the submission queue; it is flushed when more sinks start a
+ * write at once */
+#define OUT_RING_ENTRIES	8u
+
+struct out_chunk {
+	uint8_t			*data;
+	size_t			len;
+	unsigned int		refs;	/* sinks which still write it */
+};
+
+struct out_sink {
+	int			fd;
+	int			error;	/* errno of the failed write */
+	unsigned int		seq;	/* next chunk to write */
+	size_t			done;	/* bytes of it which are written */
+	bool			busy;	/* a write is in flight */
+};
+
+enum out_mode {
+	OUT_NONE,
+	OUT_RING,
+	OUT_THREAD,
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+	int			fd;
+	unsigned int		entries;
+
+	void			*sq_map;
+	size_t			sq_map_size;
+	void			*cq_map;
+	size_t			cq_map_size;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	unsigned int		to_submit;
+};
+#endif
+
+struct out_queue {
+	enum out_mode		mode;	/* OUT_NONE until set up */
+	struct out_chunk	chunks[OUT_DEPTH];
+	uint8_t			*data;
+	size_t			chunk_size;
+
+	/* sinks of the current stream */
+	struct out_sink		*sinks;
+	unsigned int		num_sinks;
+	unsigned int		max_sinks;
+	unsigned int		seq;	/* next chunk to fill */
+
+#ifdef HAVE_IO_URING
+	struct uring		ring;
+#endif
+
+	/* writer thread */
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		wseq;	/* next chunk to write */
+	bool			closing;
+};
+
+static unsigned int out_live_sinks(struct out_queue const *q)
+{
+	unsigned int	cnt = 0;
+
+	for (unsigned int i = 0; i < q->num_sinks; ++i)
+		cnt += q->sinks[i].error == 0;
+
+	return cnt;
+}
+
+#ifdef HAVE_IO_URING
+static void uring_free(struct uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_map)
+		munmap(r->cq_map, r->cq_map_size);
+	if (r->sq_map)
+		munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+}
+
+/* sets up a ring for 'entries' writes; fails silently so that the
+ * caller can fall back to the writer thread */
+static int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params	p;
+
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -1;
+
+	/* IORING_OP_WRITE at the current file position; completions of
+	 * more writes than the queue size must not be dropped */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS) ||
+	    !(p.features & IORING_FEAT_NODROP))
+		goto err;
+
+	r->entries     = p.sq_entries;
+	r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size   = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) {
+		r->sq_map = NULL;
+		goto err;
+	}
+
+	r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_map == MAP_FAILED) {
+		r->cq_map = NULL;
+		goto err;
+	}
+
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto err;
+	}
+
+	r->sq_head  = (void *)((char *)r->sq_map + p.sq_off.head);
+	r->sq_tail  = (void *)((char *)r->sq_map + p.sq_off.tail);
+	r->sq_mask  = (void *)((char *)r->sq_map + p.sq_off.ring_mask);
+	r->sq_array = (void *)((char *)r->sq_map + p.sq_off.array);
+	r->cq_head  = (void *)((char *)r->cq_map + p.cq_off.head);
+	r->cq_tail  = (void *)((char *)r->cq_map + p.cq_off.tail);
+	r->cq_mask  = (void *)((char *)r->cq_map + p.cq_off.ring_mask);
+	r->cqes     = (void *)((char *)r->cq_map + p.cq_off.cqes);
+
+	return 0;
+
+err:
+	uring_free(r);
+	return -1;
+}
+
+static bool uring_full(struct uring const *r)
+{
+	return (*r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) ==
+		r->entries);
+}
+
+static void uring_write(struct uring *r, int fd, void const *buf, size_t len,
+			uint64_t user_data)
+{
+	unsigned int		tail = *r->sq_tail;
+	unsigned int		idx  = tail & *r->sq_mask;
+	struct io_uring_sqe	*sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof *sqe);
+	sqe->opcode    = IORING_OP_WRITE;
+	sqe->fd        = fd;
+	sqe->addr      = (uintptr_t)buf;
+	sqe->len       = MIN(len, (size_t)INT_MAX);
+	sqe->off       = (uint64_t)-1;
+	sqe->user_data = user_data;
+
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->to_submit;
+}
+
+/* submits the queued writes and waits for 'min_complete' of them */
+static int uring_enter(struct uring *r, unsigned int min_complete)
+{
+	for (;;) {
+		int	rc = syscall(__NR_io_uring_enter, r->fd, r->to_submit,
+				     min_complete,
+				     min_complete ? IORING_ENTER_GETEVENTS : 0,
+				     NULL, 0);
+
+		if (rc >= 0) {
+			r->to_submit -= MIN((unsigned int)rc, r->to_submit);
+			return 0;
+		}
+
+		if (errno != EINTR) {
+			perror("io_uring_enter()");
+			return -1;
+		}
+	}
+}
+#endif
+
+static void out_sink_fail(struct out_queue *q, struct out_sink *s, int err)
+{
+	errno = err;
+	perror("write()");
+
+	s->error = err;
+
+	/* release the chunks which were not written yet */
+	for (unsigned int seq = s->seq; seq != q->seq; ++seq)
+		--q->chunks[seq % OUT_DEPTH].refs;
+}
+
+#ifdef HAVE_IO_URING
+/* starts the next write of every idle sink */
+static int out_ring_submit(struct out_queue *q)
+{
+	for (unsigned int i = 0; i < q->num_sinks; ++i) {
+		struct out_sink		*s = &q->sinks[i];
+		struct out_chunk const	*c = &q->chunks[s->seq % OUT_DEPTH];
+
+		if (s->busy || s->error || s->seq == q->seq)
+			continue;
+
+		if (uring_full(&q->ring) && uring_enter(&q->ring, 0) < 0)
+			return -1;
+
+		uring_write(&q->ring, s->fd, c->data + s->done,
+			    c->len - s->done, i);
+		s->busy = true;
+	}
+
+	return uring_enter(&q->ring, 0);
+}
+
+/* waits for at least one write and processes all completed ones */
+static int out_ring_reap(struct out_queue *q)
+{
+	struct uring	*r = &q->ring;
+	unsigned int	head;
+
+	if (uring_enter(r, 1) < 0)
+		return -1;
+
+	head = *r->cq_head;
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe const	*cqe = &r->cqes[head & *r->cq_mask];
+		struct out_sink			*s = &q->sinks[cqe->user_data];
+		struct out_chunk		*c = &q->chunks[s->seq % OUT_DEPTH];
+
+		s->busy = false;
+
+		if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+			/* retried by the next out_ring_submit() */
+		} else if (cqe->res < 0) {
+			out_sink_fail(q, s, -cqe->res);
+		} else if (cqe->res == 0) {
+			out_sink_fail(q, s, EIO);
+		} else {
+			s->done += cqe->res;
+			if (s->done == c->len) {
+				--c->refs;
+				++s->seq;
+				s->done = 0;
+			}
+		}
+
+		++head;
+	}
+
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	return out_ring_submit(q);
+}
+#endif
+
+static void *out_writer(void *q_v)
+{
+	struct out_queue	*q = q_v;
+
+	pthread_mutex_lock(&q->lock);
+
+	for (;;) {
+		struct out_chunk	*c;
+
+		while (q->wseq == q->seq && !q->closing)
+			pthread_cond_wait(&q->cond, &q->lock);
+
+		if (q->wseq == q->seq)
+			break;
+
+		c = &q->chunks[q->wseq % OUT_DEPTH];
+		pthread_mutex_unlock(&q->lock);
+
+		for (unsigned int i = 0; i < q->num_sinks; ++i) {
+			struct out_sink	*s = &q->sinks[i];
+			int		err;
+
+			if (s->error)
+				continue;
+
+			err = write_all(s->fd, c->data, c->len) < 0 ? errno : 0;
+
+			if (err) {
+				pthread_mutex_lock(&q->lock);
+				s->error = err;
+				pthread_mutex_unlock(&q->lock);
+			}
+		}
+
+		pthread_mutex_lock(&q->lock);
+		c->refs = 0;
+		++q->wseq;
+		pthread_cond_broadcast(&q->cond);
+	}
+
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/* allocates the chunks and sets up the ring or the writer thread */
+static int out_init(struct out_queue *q, size_t chunk_size)
+{
+	memset(q, 0, sizeof *q);
+
+	q->data = malloc(chunk_size * OUT_DEPTH);
+	if (!q->data) {
+		perror("malloc(<output>)");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < OUT_DEPTH; ++i)
+		q->chunks[i].data = q->data + i * chunk_size;
+
+	q->chunk_size = chunk_size;
+
+#ifdef HAVE_IO_URING
+	if (uring_init(&q->ring, OUT_RING_ENTRIES) == 0) {
+		q->mode = OUT_RING;
+		return 0;
+	}
+#endif
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	errno = pthread_create(&q->thread, NULL, out_writer, q);
+	if (errno) {
+		perror("pthread_create()");
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		free(q->data);
+		q->data = NULL;
+		return -1;
+	}
+
+	q->mode = OUT_THREAD;
+	return 0;
+}
+
+static void out_free(struct out_queue *q)
+{
+	switch (q->mode) {
+	case OUT_NONE:
+		return;
+
+#ifdef HAVE_IO_URING
+	case OUT_RING:
+		uring_free(&q->ring);
+		break;
+#endif
+
+	case OUT_THREAD:
+		pthread_mutex_lock(&q->lock);
+		q->closing = true;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+
+		pthread_join(q->thread, NULL);
+		pthread_cond_destroy(&q->cond);
+		pthread_mutex_destroy(&q->lock);
+		break;
+	}
+
+	free(q->sinks);
+	free(q->data);
+	q->mode = OUT_NONE;
+}
+
+/* Starts a stream to 'fds'.  The sink array only grows when a stream
+ * has more sinks than the previous ones. */
+static int out_start(struct out_queue *q, int const *fds, unsigned int num_fds)
+{
+	if (num_fds > q->max_sinks) {
+		struct out_sink	*sinks = realloc(q->sinks, num_fds * sizeof sinks[0]);
+
+		if (!sinks) {
+			perror("realloc(<sinks>)");
+			return -1;
+		}
+
+		q->sinks     = sinks;
+		q->max_sinks = num_fds;
+	}
+
+	/* the previous stream has been drained by out_finish() and the
+	 * writer thread waits for new chunks */
+	if (q->mode == OUT_THREAD)
+		pthread_mutex_lock(&q->lock);
+
+	for (unsigned int i = 0; i < num_fds; ++i)
+		q->sinks[i] = (struct out_sink) { .fd = fds[i] };
+
+	q->num_sinks = num_fds;
+	q->seq       = 0;
+	q->wseq      = 0;
+
+	for (unsigned int i = 0; i < OUT_DEPTH; ++i)
+		q->chunks[i].refs = 0;
+
+	if (q->mode == OUT_THREAD)
+		pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+/* Returns the buffer for the next chunk once all sinks have written its
+ * previous content, or NULL when no sink is left. */
+static uint8_t *out_get(struct out_queue *q)
+{
+	struct out_chunk	*c = &q->chunks[q->seq % OUT_DEPTH];
+	bool			live;
+
+	/* without sinks, the same chunk is filled again */
+	if (q->num_sinks == 0)
+		return c->data;
+
+	switch (q->mode) {
+#ifdef HAVE_IO_URING
+	case OUT_RING:
+		while (c->refs > 0) {
+			if (out_ring_reap(q) < 0)
+				return NULL;
+		}
+
+		live = out_live_sinks(q) > 0;
+		break;
+#endif
+
+	case OUT_THREAD:
+		pthread_mutex_lock(&q->lock);
+		while (c->refs > 0)
+			pthread_cond_wait(&q->cond, &q->lock);
+		live = out_live_sinks(q) > 0;
+		pthread_mutex_unlock(&q->lock);
+		break;
+
+	default:
+		assert(0);
+		return NULL;
+	}
+
+	return live ? c->data : NULL;
+}
+
+/* queues the chunk returned by out_get() */
+static int out_put(struct out_queue *q, size_t len)
+{
+	struct out_chunk	*c = &q->chunks[q->seq % OUT_DEPTH];
+
+	if (q->num_sinks == 0)
+		return 0;
+
+	switch (q->mode) {
+#ifdef HAVE_IO_URING
+	case OUT_RING:
+		c->len  = len;
+		c->refs = out_live_sinks(q);
+		++q->seq;
+		return out_ring_submit(q);
+#endif
+
+	case OUT_THREAD:
+		pthread_mutex_lock(&q->lock);
+		c->len  = len;
+		c->refs = 1;
+		++q->seq;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		return 0;
+
+	default:
+		assert(0);
+		return -1;
+	}
+}
+
+/* waits until the stream is written; returns -1 when a sink failed */
+static int out_finish(struct out_queue *q)
+{
+	int	rc = 0;
+
+	switch (q->mode) {
+#ifdef HAVE_IO_URING
+	case OUT_RING:
+		for (unsigned int i = 0; i < q->num_sinks && rc == 0; ++i) {
+			struct out_sink const	*s = &q->sinks[i];
+
+			while (rc == 0 && !s->error && s->seq != q->seq)
+				rc = out_ring_reap(q);
+		}
+		break;
+#endif
+
+	case OUT_THREAD:
+		pthread_mutex_lock(&q->lock);
+		while (q->wseq != q->seq)
+			pthread_cond_wait(&q->cond, &q->lock);
+		pthread_mutex_unlock(&q->lock);
+		break;
+
+	default:
+		break;
+	}
+
+	if (out_live_sinks(q) != q->num_sinks)
+		rc = -1;
+
+	return rc;
+}
+
+static int init_color(struct fbinfo *fb, char const *opt, uint64_t *col)
+{
+	uint64_t	res;
+
+	switch (fb->var.bits_per_pixel) {
+	case 8:
+		if (fb_has_cmap(fb) && initPalette(fb->fd, opt, &fb->var) < 0)
+			return -1;
+
+		if (opt[0]=='#')
+			res = atoi(opt+1);
+		else if (opt[0]=='g')
+			res = atoi(opt+1)+200;
+		else if (opt[0]=='p')
+			res = 211;
+		else
+			res = atoi(opt)+100;
+
+		break;
+
+	case 1:
+	case 2:
+	case 4:
+		res = MIN(strtoul(opt, NULL, 0),
+			  (1ul << fb->var.bits_per_pixel) - 1u);
+		break;
+
+	case 16	:
+	case 24:
+	case 32	:
+	case 48:
+	case 64:
+		res = strtoull(opt, NULL, 0);
+		break;
+
+	default:
+		fprintf(stderr, "Colors not supported with %ubpp\n",
+			fb->var.bits_per_pixel);
+		return -1;
+	}
+
+	*col = res;
+	return 0;
+}
+
+static void dshade_next_color(struct rgb_pix *col,
+			      struct fb_var_screeninfo const *info)
+{
+	uint16_t	*this_c;
+	uint16_t	*next_c;
+	uint16_t	max;
+
+	if (col->r != 0 || (col->g == 0 && col->b == 0)) {
+		this_c = &col->r;
+		next_c = &col->g;
+		max    = (1u << info->red.length) - 1;
+	} else if (col->g != 0) {
+		this_c = &col->g;
+		next_c = &col->b;
+		max    = (1u << info->green.length) - 1;
+	} else if (col->b != 0) {
+		this_c = &col->b;
+		next_c = &col->r;
+		max    = (1u << info->blue.length) - 1;
+	} else {
+		abort();
+	}
+
+	if (*this_c == max) {
+		*this_c = 0;
+		*next_c = 1;
+	} else {
+		*this_c += 1;
+	}
+}
+
+static void render_dshade(struct fbinfo *fb)
+{
+	switch (fb->var.bits_per_pixel) {
+	case 8	: {
+		/* TODO: implement me! */
+		abort();
+		break;
+	}
+
+	case 16:
+	case 24:
+	case 32:
+	case 48:
+	case 64: {
+		struct rgb_pix	col = { 0,0,0,0 };
+
+		for (unsigned int x = 0; x < fb->var.xres; ++x) {
+			void		*ptr;
+			struct rgb_pix	cur_col = col;
+
+			ptr = fb->buf + get_pix_ofs(x, 0, &fb->var);
+
+			for (unsigned int y = 0; y < fb->var.yres; ++y) {
+				setPixelRGBCol(ptr, &fb->var, col.r, col.g, col.b);
+				dshade_next_color(&col, &fb->var);
+
+				ptr += fb->stride;
+			}
+
+			col = cur_col;
+			dshade_next_color(&col, &fb->var);
+		}
+		break;
+	}
+
+
+	default:
+		abort();
+	}
+}
+
+static void render_cross(struct fbinfo *fb)
+{
+	switch (fb->var.bits_per_pixel) {
+	case 8	: {
+		/* TODO: implement me! */
+		abort();
+		break;
+	}
+
+	case 16:
+	case 24:
+	case 32:
+	case 48:
+	case 64: {
+		unsigned int	y = 0;
+		int		dir = 1;
+		uint32_t	col0 = 0xff00ffff;
+		uint32_t	col1 = 0xfff00fff;
+
+		for (unsigned int x = 0; x < fb->var.xres; ++x) {
+			void		*ptr;
+
+			ptr = fb->buf + get_pix_ofs(x, y, &fb->var);
+			setPixelRGBRaw(ptr, &fb->var,
+				       x % 2 ? col0 : ror32_1(col0));
+
+			ptr = fb->buf + get_pix_ofs(x, fb->var.yres - y - 1, &fb->var);
+			setPixelRGBRaw(ptr, &fb->var,
+				       x % 2 ? col1 : ror32_1(col1));
+
+			if (dir > 0 && y + dir >= fb->var.yres) {
+				dir = -1;
+				col1 = ror32_8(col1);
+			} else if (dir < 0 && y < (unsigned int)(-dir)) {
+				dir = +1;
+				col0 = ror32_8(col0);
+			}
+
+			y += dir;
+		}
+		break;
+	}
+
+	default:
+		abort();
+	}
+}
+
+static void render_solid(struct fbinfo *fb, uint64_t col)
+{
+	switch (fb->var.bits_per_pixel) {
+	case 1:
+	case 2:
+	case 4:
+		memset(fb->buf, packed_level_byte(col, fb->var.bits_per_pixel),
+		       fb->stride * fb->var.yres_virtual);
+		break;
+
+	case 8	:
+		memset(fb->buf, col, fb->var.xres_virtual*fb->var.yres_virtual);
+		break;
+
+	case 16	:
+	case 24:
+	case 32	:
+	case 48:
+	case 64	: {
+		size_t		i   = fb->var.xres_virtual*fb->var.yres_virtual;
+		void		*buf = fb->buf;
+
+		while (i-->0)
+			buf = setPixelRGBRaw(buf, &fb->var, col);
+		break;
+	}
+	}
+}
+
+static char const *ppm_skip_ws(char const *ptr, char const *end)
+{
+	while (ptr < end) {
+		if (*ptr == '#') {
+			while (ptr < end && *ptr != '\n')
+				++ptr;
+		} else if (*ptr == ' ' || *ptr == '\t' ||
+			   *ptr == '\n' || *ptr == '\r') {
+			++ptr;
+		} else {
+			break;
+		}
+	}
+
+	return ptr;
+}
+
+static char const *ppm_parse_uint(char const *ptr, char const *end,
+				  unsigned int *res)
+{
+	unsigned long	v = 0;
+
+	ptr = ppm_skip_ws(ptr, end);
+	if (ptr == end || *ptr < '0' || *ptr > '9')
+		return NULL;
+
+	while (ptr < end && *ptr >= '0' && *ptr <= '9' && v < 0x1000000)
+		v = v * 10 + (*ptr++ - '0');
+
+	*res = v;
+	return ptr;
+}
+
+/* bytes per pixel of an image */
+static unsigned int image_Bpp(struct fbt_image const *img)
+{
+	return img->maxval == 255 ? 3 : 6;
+}
+
+int fbt_ppm_open(char const *fname, struct fbt_image *img)
+{
+	int		fd;
+	struct stat	st;
+	char const	*ptr;
+	char const	*end;
+
+	memset(img, 0, sizeof *img);
+
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Can not open '%s': %m\n", fname);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < 3) {
+		fprintf(stderr, "Can not read '%s'\n", fname);
+		close(fd);
+		return -1;
+	}
+
+	img->map_size = st.st_size;
+	img->map      = mmap(NULL, img->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (img->map == MAP_FAILED) {
+		perror("mmap(<ppm>)");
+		return -1;
+	}
+
+	ptr = img->map;
+	end = ptr + img->map_size;
+
+	if (ptr[0] != 'P' || ptr[1] != '6')
+		goto err;
+
+	ptr = ppm_parse_uint(ptr + 2, end, &img->width);
+	if (ptr)
+		ptr = ppm_parse_uint(ptr, end, &img->height);
+	if (ptr)
+		ptr = ppm_parse_uint(ptr, end, &img->maxval);
+
+	/* exactly one whitespace character separates header and data */
+	if (!ptr || ptr == end || (img->maxval != 255 && img->maxval != 65535))
+		goto err;
+
+	img->data = (uint8_t const *)ptr + 1;
+
+	if ((size_t)(end - (char const *)img->data) / image_Bpp(img) / MAX(img->width, 1u) <
+	    img->height)
+		goto err;
+
+	return 0;
+
+err:
+	fprintf(stderr, "'%s' is not a supported PPM image\n", fname);
+	munmap(img->map, img->map_size);
+	img->map = NULL;
+	return -1;
+}
+
+void fbt_ppm_close(struct fbt_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->map_size);
+}
+
+static inline uint32_t ppm_sample_scale(uint32_t v, unsigned int src_bits,
+					struct fb_bitfield const *f)
+{
+	if (f->length <= src_bits)
+		return v >> (src_bits - f->length);
+	else
+		return v << (f->length - src_bits);
+}
+
+/* copies the image into the top left corner of the framebuffer; the
+ * uncovered area is cleared */
+static int blit_ppm(struct fbinfo *fb, struct fbt_image const *img)
+{
+	unsigned int const	w = MIN(img->width,  fb->var.xres);
+	unsigned int const	h = MIN(img->height, fb->var.yres);
+	unsigned int const	src_bits = img->maxval == 255 ? 8 : 16;
+	unsigned int const	Bpp = image_Bpp(img);
+
+	switch (fb->var.bits_per_pixel) {
+	case 16:
+	case 24:
+	case 32:
+	case 48:
+	case 64:
+		break;
+
+	default:
+		fprintf(stderr, "Can not blit images with %ubpp\n",
+			fb->var.bits_per_pixel);
+		return -1;
+	}
+
+	if (w < fb->var.xres || h < fb->var.yres)
+		render_solid(fb, 0);
+
+	for (unsigned int y = 0; y < h; ++y) {
+		uint8_t const	*src = img->data + (size_t)y * img->width * Bpp;
+		void		*ptr = fb->buf + y * fb->stride;
+
+		for (unsigned int x = 0; x < w; ++x) {
+			uint32_t	r, g, b;
+
+			if (src_bits == 8) {
+				r = src[0];
+				g = src[1];
+				b = src[2];
+			} else {
+				r = (src[0] << 8) | src[1];
+				g = (src[2] << 8) | src[3];
+				b = (src[4] << 8) | src[5];
+			}
+
+			ptr = setPixelRGBRaw(ptr, &fb->var,
+					     chan_encode(ppm_sample_scale(r, src_bits, &fb->var.red),   &fb->var.red) |
+					     chan_encode(ppm_sample_scale(g, src_bits, &fb->var.green), &fb->var.green) |
+					     chan_encode(ppm_sample_scale(b, src_bits, &fb->var.blue),  &fb->var.blue));
+			src += Bpp;
+		}
+	}
+
+	return 0;
+}
+
+/* height and width of the cells used to locate mismatching regions;
+ * worker bands are aligned to it so that no cell is shared */
+#define CMP_TILE	16
+
+typedef uint8_t		v16u8 __attribute__((__vector_size__(16)));
+
+struct cmp_tile {
+	unsigned int		x0;
+	unsigned int		x1;
+	unsigned int		y0;
+	unsigned int		y1;
+	unsigned int		cnt;
+};
+
+struct cmp_ctx {
+	struct fbinfo const	*fb;
+	struct fbt_image const	*ref;
+	struct pix_conv const	*conv;
+	unsigned int		tolerance;
+	unsigned int		tiles_x;
+	unsigned int		tiles_y;
+	struct cmp_tile		*tiles;
+	uint8_t			*diff;
+};
+
+struct cmp_job {
+	struct cmp_ctx const	*ctx;
+	struct cmp_pool		*pool;
+	pthread_t		thread;
+	uint8_t			*row;	/* converted screen row */
+	unsigned int		y0;
+	unsigned int		y1;
+	uint64_t		mismatches;
+	uint64_t		sse;
+};
+
+/* Worker threads which are kept between comparisons; the thread of
+ * jobs[i] handles the band 'i' while the calling thread does the first
+ * one. */
+struct cmp_pool {
+	struct cmp_job		*jobs;
+	unsigned int		num_threads;	/* started for jobs[1..] */
+
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	unsigned int		gen;		/* incremented per comparison */
+	unsigned int		num_jobs;	/* bands of the current one */
+	unsigned int		pending;	/* workers not done yet */
+	bool			closing;
+};
+
+static inline v16u8 v16u8_load(uint8_t const *ptr)
+{
+	v16u8	v;
+
+	memcpy(&v, ptr, sizeof v);
+	return v;
+}
+
+static inline v16u8 v16u8_absdiff(v16u8 a, v16u8 b)
+{
+	v16u8	gt = (v16u8)(a > b);
+
+	return ((a - b) & gt) | ((b - a) & ~gt);
+}
+
+static inline bool v16u8_is_zero(v16u8 v)
+{
+	uint64_t	q[2];
+
+	memcpy(q, &v, sizeof q);
+	return (q[0] | q[1]) == 0;
+}
+
+static void cmp_pixel(struct cmp_job *job, uint8_t const *a, uint8_t const *b,
+		      unsigned int x, unsigned int y)
+{
+	struct cmp_ctx const	*ctx = job->ctx;
+	unsigned int		max_d = 0;
+
+	for (unsigned int i = 0; i < 3; ++i) {
+		unsigned int	d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+		job->sse += d * d;
+		max_d     = MAX(max_d, d);
+	}
+
+	if (max_d > ctx->tolerance) {
+		struct cmp_tile	*t = &ctx->tiles[(y / CMP_TILE) * ctx->tiles_x +
+						 x / CMP_TILE];
+
+		if (t->cnt == 0) {
+			t->x0 = t->x1 = x;
+			t->y0 = t->y1 = y;
+		} else {
+			t->x0 = MIN(t->x0, x);
+			t->x1 = MAX(t->x1, x);
+			t->y1 = y;
+		}
+
+		++t->cnt;
+		++job->mismatches;
+	}
+}
+
+/* Compares a row of RGB888 pixels.  Blocks of 16 pixels are checked with
+ * vector operations first; only blocks which are not identical are
+ * examined per pixel. */
+static void cmp_row(struct cmp_job *job, uint8_t const *a, uint8_t const *b,
+		    unsigned int y)
+{
+	unsigned int const	w = job->ctx->fb->var.xres;
+	unsigned int		x = 0;
+
+	for (; x + 16 <= w; x += 16) {
+		v16u8	d0 = v16u8_absdiff(v16u8_load(a +  0), v16u8_load(b +  0));
+		v16u8	d1 = v16u8_absdiff(v16u8_load(a + 16), v16u8_load(b + 16));
+		v16u8	d2 = v16u8_absdiff(v16u8_load(a + 32), v16u8_load(b + 32));
+
+		if (!v16u8_is_zero(d0 | d1 | d2)) {
+			for (unsigned int i = 0; i < 16; ++i)
+				cmp_pixel(job, a + i * 3, b + i * 3, x + i, y);
+		}
+
+		a += 48;
+		b += 48;
+	}
+
+	for (; x < w; ++x) {
+		cmp_pixel(job, a, b, x, y);
+		a += 3;
+		b += 3;
+	}
+}
+
+static void cmp_diff_row(struct cmp_ctx const *ctx, uint8_t *out,
+			 uint8_t const *a, uint8_t const *b)
+{
+	for (unsigned int x = 0; x < ctx->fb->var.xres; ++x) {
+		unsigned int	max_d = 0;
+
+		for (unsigned int i = 0; i < 3; ++i) {
+			unsigned int	d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+			max_d = MAX(max_d, d);
+		}
+
+		if (max_d > ctx->tolerance) {
+			out[0] = 255;
+			out[1] = 0;
+			out[2] = 0;
+		} else {
+			/* dimmed reference as context */
+			out[0] = out[1] = out[2] = (b[0] + b[1] + b[2]) / 12;
+		}
+
+		out += 3;
+		a   += 3;
+		b   += 3;
+	}
+}
+
+static void cmp_worker(struct cmp_job *job)
+{
+	struct cmp_ctx const	*ctx = job->ctx;
+	size_t const		row_len = (size_t)ctx->fb->var.xres * 3;
+	uint8_t			*row = job->row;
+
+	for (unsigned int y = job->y0; y < job->y1; ++y) {
+		uint8_t const	*ref = ctx->ref->data + y * row_len;
+
+		ctx->conv->row(row, ctx->fb->buf + y * ctx->fb->stride,
+			       ctx->fb->var.xres, ctx->conv);
+		cmp_row(job, row, ref, y);
+
+		if (ctx->diff)
+			cmp_diff_row(ctx, ctx->diff + y * row_len, row, ref);
+	}
+}
+
+static void *cmp_thread(void *job_v)
+{
+	struct cmp_job		*job = job_v;
+	struct cmp_pool		*pool = job->pool;
+	unsigned int const	idx = job - pool->jobs;
+	unsigned int		gen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (pool->gen == gen && !pool->closing)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if (pool->closing)
+			break;
+
+		gen = pool->gen;
+		if (idx >= pool->num_jobs)
+			continue;
+
+		pthread_mutex_unlock(&pool->lock);
+		cmp_worker(job);
+		pthread_mutex_lock(&pool->lock);
+
+		if (--pool->pending == 0)
+			pthread_cond_broadcast(&pool->cond);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* starts up to num_jobs - 1 threads; fewer ones are not an error */
+static void cmp_pool_init(struct cmp_pool *pool, struct cmp_job *jobs,
+			  unsigned int num_jobs)
+{
+	memset(pool, 0, sizeof *pool);
+
+	pool->jobs = jobs;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (unsigned int i = 1; i < num_jobs; ++i) {
+		jobs[i].pool = pool;
+
+		errno = pthread_create(&jobs[i].thread, NULL, cmp_thread, &jobs[i]);
+		if (errno) {
+			perror("pthread_create(<compare>)");
+			break;
+		}
+
+		++pool->num_threads;
+	}
+}
+
+static void cmp_pool_free(struct cmp_pool *pool)
+{
+	if (!pool->jobs)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closing = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (unsigned int i = 1; i <= pool->num_threads; ++i)
+		pthread_join(pool->jobs[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	pool->jobs = NULL;
+}
+
+/* Runs the comparison in bands of whole cells; the first band is handled
+ * by the calling thread.  Returns the number of mismatches. */
+static uint64_t cmp_run(struct cmp_ctx const *ctx, struct cmp_pool *pool,
+			uint64_t *sse)
+{
+	struct cmp_job		*jobs = pool->jobs;
+	unsigned int const	yres = ctx->fb->var.yres;
+	unsigned int		num_jobs = MAX(1u, MIN(pool->num_threads + 1,
+						       ctx->tiles_y));
+	unsigned int		rows_per_job;
+	uint64_t		mismatches = 0;
+
+	rows_per_job = ((ctx->tiles_y + num_jobs - 1) / num_jobs) * CMP_TILE;
+	*sse         = 0;
+
+	for (unsigned int i = 0; i < num_jobs; ++i) {
+		struct cmp_job	*job = &jobs[i];
+
+		job->ctx        = ctx;
+		job->y0         = MIN(i * rows_per_job, yres);
+		job->y1         = MIN(job->y0 + rows_per_job, yres);
+		job->mismatches = 0;
+		job->sse        = 0;
+	}
+
+	if (num_jobs > 1) {
+		pthread_mutex_lock(&pool->lock);
+		pool->num_jobs = num_jobs;
+		pool->pending  = num_jobs - 1;
+		++pool->gen;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	cmp_worker(&jobs[0]);
+
+	if (num_jobs > 1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->pending > 0)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	for (unsigned int i = 0; i < num_jobs; ++i) {
+		mismatches += jobs[i].mismatches;
+		*sse       += jobs[i].sse;
+	}
+
+	return mismatches;
+}
+
+/* merges adjacent cells with mismatches into regions; 'seen' and 'stack'
+ * have room for all cells */
+static void cmp_regions(struct cmp_ctx const *ctx, bool *seen, size_t *stack,
+			void (*fn)(struct fbt_region const *region, void *data),
+			void *data)
+{
+	size_t const	num = (size_t)ctx->tiles_x * ctx->tiles_y;
+
+	memset(seen, 0, num * sizeof seen[0]);
+
+	for (size_t i = 0; i < num; ++i) {
+		struct cmp_tile		box;
+		struct fbt_region	region;
+		size_t			sp = 0;
+
+		if (seen[i] || ctx->tiles[i].cnt == 0)
+			continue;
+
+		box = ctx->tiles[i];
+		box.cnt = 0;
+		seen[i] = true;
+		stack[sp++] = i;
+
+		while (sp > 0) {
+			size_t			idx = stack[--sp];
+			struct cmp_tile const	*t = &ctx->tiles[idx];
+			int			tx = idx % ctx->tiles_x;
+			int			ty = idx / ctx->tiles_x;
+
+			box.x0   = MIN(box.x0, t->x0);
+			box.x1   = MAX(box.x1, t->x1);
+			box.y0   = MIN(box.y0, t->y0);
+			box.y1   = MAX(box.y1, t->y1);
+			box.cnt += t->cnt;
+
+			for (int dy = -1; dy <= 1; ++dy) {
+				for (int dx = -1; dx <= 1; ++dx) {
+					int	nx = tx + dx;
+					int	ny = ty + dy;
+					size_t	n;
+
+					if (nx < 0 || ny < 0 ||
+					    nx >= (int)ctx->tiles_x ||
+					    ny >= (int)ctx->tiles_y)
+						continue;
+
+					n = (size_t)ny * ctx->tiles_x + nx;
+					if (seen[n] || ctx->tiles[n].cnt == 0)
+						continue;
+
+					seen[n] = true;
+					stack[sp++] = n;
+				}
+			}
+		}
+
+		region.x0     = box.x0;
+		region.y0     = box.y0;
+		region.x1     = box.x1;
+		region.y1     = box.y1;
+		region.pixels = box.cnt;
+
+		fn(&region, data);
+	}
+}
+
+static void render_bars(struct fbinfo *fb)
+{
+	switch (fb->var.bits_per_pixel) {
+	case 1	:
+	case 2	:
+	case 4	:
+		displayPacked(&fb->var, fb->buf);
+		break;
+	case 8	:
+		displayPalette(&fb->var, fb->buf);
+		break;
+	default	:
+		displayRGB(&fb->var, fb->buf);
+		break;
+	}
+}
+
+/* stores a native value at a physical position; selected once per
+ * context by put_pix_select() */
+typedef void (*put_pix_fn)(struct fbinfo *fb, unsigned int x, unsigned int y,
+			   uint64_t col);
+
+#define DEFINE_PUT_PIX(NAME, TYPE)					\
+static void put_pix_##NAME(struct fbinfo *fb, unsigned int x,		\
+			   unsigned int y, uint64_t col)		\
+{									\
+	((TYPE *)((char *)fb->buf + y * fb->stride))[x] = col;		\
+}
+
+DEFINE_PUT_PIX(8,  uint8_t)
+DEFINE_PUT_PIX(16, uint16_t)
+DEFINE_PUT_PIX(32, uint32_t)
+DEFINE_PUT_PIX(64, uint64_t)
+
+#undef DEFINE_PUT_PIX
+
+static void put_pix_24(struct fbinfo *fb, unsigned int x, unsigned int y,
+		       uint64_t col)
+{
+	setPixelRGBRaw((char *)fb->buf + y * fb->stride + x * 3, &fb->var, col);
+}
+
+static void put_pix_48(struct fbinfo *fb, unsigned int x, unsigned int y,
+		       uint64_t col)
+{
+	setPixelRGBRaw((char *)fb->buf + y * fb->stride + x * 6, &fb->var, col);
+}
+
+static void put_pix_packed(struct fbinfo *fb, unsigned int x, unsigned int y,
+			   uint64_t col)
+{
+	packed_set((uint8_t *)fb->buf + y * fb->stride, x, col,
+		   fb->var.bits_per_pixel);
+}
+
+static put_pix_fn put_pix_select(unsigned int bpp)
+{
+	switch (bpp) {
+	case 1:
+	case 2:
+	case 4:		return put_pix_packed;
+	case 8:		return put_pix_8;
+	case 16:	return put_pix_16;
+	case 24:	return put_pix_24;
+	case 32:	return put_pix_32;
+	case 48:	return put_pix_48;
+	case 64:	return put_pix_64;
+	default:	return NULL;
+	}
+}
+
+struct seq_entry {
+	unsigned int		duration_ms;
+	char			*pattern;
+	char			*arg;
+	unsigned int		lineno;
+
+	/* either a page of the virtual screen or a shadow buffer */
+	void			*frame;
+	bool			is_shadow;
+	unsigned int		page;
+};
+
+struct sequence {
+	struct seq_entry	*entries;
+	size_t			num;
+};
+
+static void sequence_free(struct sequence *seq)
+{
+	for (size_t i = 0; i < seq->num; ++i) {
+		struct seq_entry	*e = &seq->entries[i];
+
+		if (e->is_shadow)
+			free(e->frame);
+
+		free(e->pattern);
+		free(e->arg);
+	}
+
+	free(seq->entries);
+}
+
+/* Reads a sequence file.  Each non-empty line which does not start with
+ * '#' has the form
+ *
+ *   <duration-ms> <pattern> [<arg>]
+ *
+ * with <pattern> being 'bars', 'dshade', 'solid <color>' or 'ppm <file>'. */
+static int sequence_read(char const *fname, struct sequence *seq)
+{
+	FILE		*f;
+	char		*line = NULL;
+	size_t		line_sz = 0;
+	unsigned int	lineno = 0;
+	int		rc = -1;
+
+	memset(seq, 0, sizeof *seq);
+
+	f = fopen(fname, "re");
+	if (!f) {
+		fprintf(stderr, "Can not open sequence '%s': %m\n", fname);
+		return -1;
+	}
+
+	while (getline(&line, &line_sz, f) >= 0) {
+		struct seq_entry	e = { .lineno = ++lineno };
+		struct seq_entry	*tmp;
+		int			cnt;
+
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#')
+			continue;
+
+		cnt = sscanf(line, "%u %ms %m[^\r\n]", &e.duration_ms, &e.pattern,
+			     &e.arg);
+		if (cnt < 2) {
+			fprintf(stderr, "%s:%u: invalid line\n", fname, lineno);
+			goto out;
+		}
+
+		if (strcmp(e.pattern, "bars") != 0 &&
+		    strcmp(e.pattern, "dshade") != 0 &&
+		    ((strcmp(e.pattern, "solid") != 0 &&
+		      strcmp(e.pattern, "ppm") != 0) || !e.arg)) {
+			fprintf(stderr, "%s:%u: unsupported pattern '%s'\n",
+				fname, lineno, e.pattern);
+			free(e.pattern);
+			free(e.arg);
+			goto out;
+		}
+
+		tmp = realloc(seq->entries, (seq->num + 1) * sizeof seq->entries[0]);
+		if (!tmp) {
+			free(e.pattern);
+			free(e.arg);
+			goto out;
+		}
+
+		seq->entries = tmp;
+		seq->entries[seq->num++] = e;
+	}
+
+	if (seq->num == 0)
+		fprintf(stderr, "%s: empty sequence\n", fname);
+	else
+		rc = 0;
+
+out:
+	free(line);
+	fclose(f);
+
+	if (rc < 0)
+		sequence_free(seq);
+
+	return rc;
+}
+
+static int sequence_render(struct fbinfo *fb, struct seq_entry const *e)
+{
+	if (strcmp(e->pattern, "bars") == 0) {
+		if (fb->var.bits_per_pixel == 8 && fb_has_cmap(fb) &&
+		    initPalette(fb->fd, NULL, &fb->var) < 0)
+			return -1;
+		render_bars(fb);
+	} else if (strcmp(e->pattern, "dshade") == 0) {
+		if (fb->var.bits_per_pixel <= 8)
+			return -1;
+		render_dshade(fb);
+	} else if (strcmp(e->pattern, "solid") == 0) {
+		uint64_t		col;
+
+		if (init_color(fb, e->arg, &col) < 0)
+			return -1;
+
+		render_solid(fb, col);
+	} else {
+		struct fbt_image	img;
+		int			rc;
+
+		if (fbt_ppm_open(e->arg, &img) < 0)
+			return -1;
+
+		rc = blit_ppm(fb, &img);
+		fbt_ppm_close(&img);
+
+		return rc;
+	}
+
+	return 0;
+}
+
+static uint64_t ts_to_ns(struct timespec const *ts)
+{
+	return (uint64_t)ts->tv_sec * 1000000000u + ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts(uint64_t ns)
+{
+	return (struct timespec) {
+		.tv_sec  = ns / 1000000000u,
+		.tv_nsec = ns % 1000000000u,
+	};
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts_to_ns(&ts);
+}
+
+
+struct fbt_ctx {
+	struct fbinfo		fb;
+	bool			attached;
+
+	/* upright orientation */
+	unsigned int		rot;
+	unsigned int		width;
+	unsigned int		height;
+	void			*shadow;	/* upright view of rotated screens */
+	char			*cache_dir;
+
+	put_pix_fn		put_pix;
+
+	/* native to RGB conversion for grabs (up to 16 bit samples) and
+	 * comparisons (8 bit samples) */
+	struct pix_conv		grab_conv;
+	struct pix_conv		cmp_conv;
+
+	uint32_t		crc_tab[4][256];
+
+	/* scratch buffers and workers of fbt_compare(); set up by its
+	 * first call */
+	unsigned int		max_jobs;
+	struct cmp_job		*jobs;
+	struct cmp_pool		pool;
+	uint8_t			*cmp_rows;
+	struct cmp_tile		*tiles;
+	bool			*seen;
+	size_t			*stack;
+
+	/* last comparison; 'tiles_y' is 0 when there is none */
+	struct cmp_ctx		cmp;
+
+	/* output of fbt_grab_write(); set up by its first call */
+	struct out_queue	out;
+};
+
+/* tables for a CRC-32 (IEEE 802.3) which processes four bytes per step */
+static void crc32_init(uint32_t tab[4][256])
+{
+	for (unsigned int i = 0; i < 256; ++i) {
+		uint32_t	c = i;
+
+		for (unsigned int k = 0; k < 8; ++k)
+			c = (c >> 1) ^ (c & 1u ? 0xedb88320u : 0);
+
+		tab[0][i] = c;
+	}
+
+	for (unsigned int i = 0; i < 256; ++i) {
+		uint32_t	c = tab[0][i];
+
+		for (unsigned int t = 1; t < 4; ++t) {
+			c = tab[0][c & 0xff] ^ (c >> 8);
+			tab[t][i] = c;
+		}
+	}
+}
+
+static uint32_t crc32_update(uint32_t const tab[4][256], uint32_t crc,
+			     void const *buf, size_t len)
+{
+	uint8_t const	*p = buf;
+
+	for (; len >= 4; len -= 4) {
+		crc ^= (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		crc  = (tab[3][crc & 0xff] ^ tab[2][(crc >> 8) & 0xff] ^
+			tab[1][(crc >> 16) & 0xff] ^ tab[0][crc >> 24]);
+		p   += 4;
+	}
+
+	while (len-- > 0)
+		crc = tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+static int ctx_init(struct fbt_ctx *ctx)
+{
+	long	nproc = sysconf(_SC_NPROCESSORS_ONLN);
+
+	ctx->put_pix = put_pix_select(ctx->fb.var.bits_per_pixel);
+	if (!ctx->put_pix) {
+		fprintf(stderr, "unsupported framebuffer with %ubpp\n",
+			ctx->fb.var.bits_per_pixel);
+		return -1;
+	}
+
+	pix_conv_init(&ctx->grab_conv, &ctx->fb.var, 16);
+	pix_conv_init(&ctx->cmp_conv,  &ctx->fb.var, 8);
+	crc32_init(ctx->crc_tab);
+
+	ctx->max_jobs = nproc > 0 ? nproc : 1;
+
+	return fbt_set_rotation(ctx, -1);
+}
+
+static int ctx_cmp_alloc(struct fbt_ctx *ctx)
+{
+	struct fb_var_screeninfo const	*var = &ctx->fb.var;
+	size_t const	num_tiles = ((size_t)(var->xres + CMP_TILE - 1) / CMP_TILE *
+				     ((var->yres + CMP_TILE - 1) / CMP_TILE));
+	/* large enough for both orientations */
+	size_t const	row_len = (size_t)MAX(var->xres, var->yres) * 3;
+
+	if (ctx->jobs)
+		return 0;
+
+	ctx->jobs     = calloc(ctx->max_jobs, sizeof ctx->jobs[0]);
+	ctx->cmp_rows = malloc(ctx->max_jobs * row_len);
+	ctx->tiles    = malloc(num_tiles * sizeof ctx->tiles[0]);
+	ctx->seen     = malloc(num_tiles * sizeof ctx->seen[0]);
+	ctx->stack    = malloc(num_tiles * sizeof ctx->stack[0]);
+
+	if (!ctx->jobs || !ctx->cmp_rows || !ctx->tiles || !ctx->seen ||
+	    !ctx->stack) {
+		perror("malloc(<compare>)");
+		free(ctx->jobs);
+		free(ctx->cmp_rows);
+		free(ctx->tiles);
+		free(ctx->seen);
+		free(ctx->stack);
+		ctx->jobs = NULL;
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < ctx->max_jobs; ++i)
+		ctx->jobs[i].row = ctx->cmp_rows + i * row_len;
+
+	cmp_pool_init(&ctx->pool, ctx->jobs, ctx->max_jobs);
+
+	return 0;
+}
+
+static int ctx_out_alloc(struct fbt_ctx *ctx)
+{
+	struct fb_var_screeninfo const	*var = &ctx->fb.var;
+	/* at least one row of both orientations */
+	size_t const	row_len = ((size_t)MAX(var->xres, var->yres) *
+				   ctx->grab_conv.out_bpp);
+
+	if (ctx->out.mode != OUT_NONE)
+		return 0;
+
+	return out_init(&ctx->out, PPM_HDR_MAX + MAX((size_t)OUT_CHUNK, row_len));
+}
+
+static int ctx_view(struct fbt_ctx *ctx, struct fbinfo *view, bool load)
+{
+	return fb_rot_view(&ctx->fb, ctx->rot, ctx->shadow, view, load);
+}
+
+struct fbt_ctx *fbt_open(char const *fbdev)
+{
+	struct fbt_ctx	*ctx = calloc(1, sizeof *ctx);
+
+	if (!ctx) {
+		perror("malloc()");
+		return NULL;
+	}
+
+	if (fb_init(fbdev, &ctx->fb) < 0) {
+		free(ctx);
+		return NULL;
+	}
+
+	if (ctx_init(ctx) < 0) {
+		fbt_close(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+struct fbt_ctx *fbt_attach(void *buf, struct fb_var_screeninfo const *var)
+{
+	struct fbt_ctx	*ctx;
+
+	if (var->xres > var->xres_virtual || var->yres > var->yres_virtual) {
+		fprintf(stderr, "invalid framebuffer layout\n");
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof *ctx);
+	if (!ctx) {
+		perror("malloc()");
+		return NULL;
+	}
+
+	ctx->attached    = true;
+	ctx->fb.var      = *var;
+	ctx->fb.fd       = -1;
+	ctx->fb.buf      = buf;
+	ctx->fb.stride   = get_line_size(var);
+	ctx->fb.buf_size = ctx->fb.stride * var->yres_virtual;
+
+	if (ctx_init(ctx) < 0) {
+		fbt_close(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void fbt_close(struct fbt_ctx *ctx)
+{
+	if (!ctx)
+		return;
+
+	if (!ctx->attached)
+		fb_free(&ctx->fb);
+
+	cmp_pool_free(&ctx->pool);
+	free(ctx->jobs);
+	free(ctx->cmp_rows);
+	free(ctx->tiles);
+	free(ctx->seen);
+	free(ctx->stack);
+	out_free(&ctx->out);
+	free(ctx->cache_dir);
+	free(ctx->shadow);
+	free(ctx);
+}
+
+struct fb_var_screeninfo const *fbt_var(struct fbt_ctx const *ctx)
+{
+	return &ctx->fb.var;
+}
+
+void fbt_geometry(struct fbt_ctx const *ctx,
+		  unsigned int *width, unsigned int *height)
+{
+	*width  = ctx->width;
+	*height = ctx->height;
+}
+
+int fbt_set_rotation(struct fbt_ctx *ctx, int rotate)
+{
+	unsigned int	rot;
+	void		*shadow = NULL;
+
+	if (rotate >= 0 && rotate % 90 != 0) {
+		fprintf(stderr, "invalid rotation %d\n", rotate);
+		return -1;
+	}
+
+	rot = fb_rotation(&ctx->fb, rotate);
+	if (rot == ctx->rot && ctx->width > 0 &&
+	    (ctx->shadow || rot == FB_ROTATE_UR))
+		return 0;
+
+	/* packed formats are rejected when a view is requested */
+	if (rot != FB_ROTATE_UR && !is_packed_bpp(ctx->fb.var.bits_per_pixel)) {
+		shadow = malloc(fb_rot_shadow_size(&ctx->fb));
+		if (!shadow) {
+			perror("malloc(<rotation>)");
+			return -1;
+		}
+	}
+
+	free(ctx->shadow);
+	ctx->shadow = shadow;
+	ctx->rot    = rot;
+
+	if (rot == FB_ROTATE_CW || rot == FB_ROTATE_CCW) {
+		ctx->width  = ctx->fb.var.yres;
+		ctx->height = ctx->fb.var.xres;
+	} else {
+		ctx->width  = ctx->fb.var.xres;
+		ctx->height = ctx->fb.var.yres;
+	}
+
+	return 0;
+}
+
+int fbt_set_cache_dir(struct fbt_ctx *ctx, char const *dir)
+{
+	char	*tmp = NULL;
+
+	if (dir) {
+		tmp = strdup(dir);
+		if (!tmp) {
+			perror("strdup()");
+			return -1;
+		}
+	}
+
+	free(ctx->cache_dir);
+	ctx->cache_dir = tmp;
+
+	return 0;
+}
+
+int fbt_parse_color(struct fbt_ctx *ctx, char const *spec, uint64_t *col)
+{
+	return init_color(&ctx->fb, spec, col);
+}
+
+int fbt_fill(struct fbt_ctx *ctx, uint64_t col)
+{
+	render_solid(&ctx->fb, col);
+	return 0;
+}
+
+int fbt_pattern(struct fbt_ctx *ctx, enum fbt_pattern pattern)
+{
+	struct fbinfo	*fb = &ctx->fb;
+	unsigned int	bpp = fb->var.bits_per_pixel;
+
+	switch (pattern) {
+	case FBT_PATTERN_BARS:
+		/* the colormap is not part of the cached frame */
+		if (bpp == 8 && fb_has_cmap(fb) &&
+		    initPalette(fb->fd, NULL, &fb->var) < 0)
+			return -1;
+
+		return render_cached(fb, ctx->cache_dir, "bars", ctx->rot,
+				     ctx->shadow, render_bars);
+
+	case FBT_PATTERN_DSHADE:
+		if (bpp <= 8)
+			break;
+
+		return render_cached(fb, ctx->cache_dir, "dshade", ctx->rot,
+				     ctx->shadow, render_dshade);
+
+	case FBT_PATTERN_CROSS: {
+		struct fbinfo	view;
+
+		if (bpp <= 8)
+			break;
+
+		/* the cross is drawn on top of the current content */
+		if (ctx_view(ctx, &view, true) < 0)
+			return -1;
+
+		render_cross(&view);
+		fb_rot_commit(fb, ctx->rot, &view);
+		return 0;
+	}
+	}
+
+	fprintf(stderr, "Pattern not supported with %ubpp\n", bpp);
+	return -1;
+}
+
+int fbt_set_pixel(struct fbt_ctx *ctx, unsigned int x, unsigned int y,
+		  uint64_t col)
+{
+	struct fbinfo	*fb = &ctx->fb;
+	unsigned int	xres = fb->var.xres;
+	unsigned int	yres = fb->var.yres;
+
+	if (x >= ctx->width || y >= ctx->height) {
+		fprintf(stderr, "Pixel %u,%u is outside of the screen\n", x, y);
+		return -1;
+	}
+
+	/* coordinates are given in the upright orientation */
+	switch (ctx->rot) {
+	case FB_ROTATE_CW:
+		ctx->put_pix(fb, xres - 1 - y, x, col);
+		break;
+	case FB_ROTATE_UD:
+		ctx->put_pix(fb, xres - 1 - x, yres - 1 - y, col);
+		break;
+	case FB_ROTATE_CCW:
+		ctx->put_pix(fb, y, yres - 1 - x, col);
+		break;
+	default:
+		ctx->put_pix(fb, x, y, col);
+		break;
+	}
+
+	return 0;
+}
+
+int fbt_blit(struct fbt_ctx *ctx, struct fbt_image const *img)
+{
+	struct fbinfo	view;
+
+	if (img->maxval != 255 && img->maxval != 65535) {
+		fprintf(stderr, "Images must have a maxval of 255 or 65535\n");
+		return -1;
+	}
+
+	if (ctx_view(ctx, &view, false) < 0)
+		return -1;
+
+	if (blit_ppm(&view, img) < 0)
+		return -1;
+
+	fb_rot_commit(&ctx->fb, ctx->rot, &view);
+	return 0;
+}
+
+size_t fbt_grab_size(struct fbt_ctx const *ctx, unsigned int *maxval)
+{
+	if (maxval)
+		*maxval = ctx->grab_conv.maxval;
+
+	return ((size_t)ctx->fb.var.xres * ctx->fb.var.yres *
+		ctx->grab_conv.out_bpp);
+}
+
+int fbt_grab(struct fbt_ctx *ctx, void *dst, size_t dst_size)
+{
+	struct fbinfo	view;
+
+	if (ctx->fb.var.bits_per_pixel == 8) {
+		fprintf(stderr, "grabbing from palette not implemented yet\n");
+		return -1;
+	}
+
+	if (dst_size < fbt_grab_size(ctx, NULL)) {
+		fprintf(stderr, "grab buffer too small\n");
+		return -1;
+	}
+
+	if (ctx_view(ctx, &view, true) < 0)
+		return -1;
+
+	grab_rows(&view, &ctx->grab_conv, 0, view.var.yres, dst);
+	return 0;
+}
+
+int fbt_grab_write(struct fbt_ctx *ctx, int const *fds, unsigned int num_fds,
+		   uint32_t *crc)
+{
+	struct pix_conv const	*conv = &ctx->grab_conv;
+	struct out_queue	*q = &ctx->out;
+	struct fbinfo		view;
+	size_t			row_len;
+	unsigned int		rows;
+	unsigned int		y = 0;
+	uint32_t		c = ~0u;
+	int			rc = 0;
+
+	if (ctx->fb.var.bits_per_pixel == 8) {
+		fprintf(stderr, "grabbing from palette not implemented yet\n");
+		return -1;
+	}
+
+	if (ctx_view(ctx, &view, true) < 0)
+		return -1;
+
+	if (ctx_out_alloc(ctx) < 0 || out_start(q, fds, num_fds) < 0)
+		return -1;
+
+	row_len = (size_t)view.var.xres * conv->out_bpp;
+	rows    = (q->chunk_size - PPM_HDR_MAX) / row_len;
+
+	do {
+		unsigned int	y1 = MIN(y + rows, view.var.yres);
+		uint8_t		*buf = out_get(q);
+		size_t		len = 0;
+
+		if (!buf) {
+			rc = -1;
+			break;
+		}
+
+		if (y == 0)
+			len = sprintf((char *)buf, "P6\n%u %u\n%u\n",
+				      view.var.xres, view.var.yres,
+				      conv->maxval);
+
+		grab_rows(&view, conv, y, y1, buf + len);
+		len += (y1 - y) * row_len;
+
+		if (crc)
+			c = crc32_update(ctx->crc_tab, c, buf, len);
+
+		if (out_put(q, len) < 0) {
+			rc = -1;
+			break;
+		}
+
+		y = y1;
+	} while (y < view.var.yres);
+
+	if (out_finish(q) < 0)
+		rc = -1;
+
+	if (crc)
+		*crc = ~c;
+
+	return rc;
+}
+
+int fbt_grab_raw(struct fbt_ctx *ctx, int fd)
+{
+	return grab_raw(&ctx->fb, fd);
+}
+
+uint32_t fbt_checksum(struct fbt_ctx const *ctx)
+{
+	struct fbinfo const	*fb = &ctx->fb;
+	size_t const		row_len = ((size_t)fb->var.xres *
+					   fb->var.bits_per_pixel + 7) / 8;
+	uint32_t		crc = ~0u;
+
+	if (row_len == fb->stride)
+		crc = crc32_update(ctx->crc_tab, crc, fb->buf,
+				   fb->stride * fb->var.yres);
+	else
+		for (unsigned int y = 0; y < fb->var.yres; ++y)
+			crc = crc32_update(ctx->crc_tab, crc,
+					   (uint8_t const *)fb->buf + y * fb->stride,
+					   row_len);
+
+	return ~crc;
+}
+
+int fbt_compare(struct fbt_ctx *ctx, struct fbt_image const *ref,
+		unsigned int tolerance, uint8_t *diff,
+		struct fbt_cmp_result *res)
+{
+	struct cmp_ctx	*cmp = &ctx->cmp;
+	struct fbinfo	scr;
+	uint64_t	mismatches;
+	uint64_t	sse;
+	uint64_t	pixels;
+
+	cmp->tiles_y = 0;
+
+	if (ctx_cmp_alloc(ctx) < 0)
+		return -1;
+
+	if (ctx_view(ctx, &scr, true) < 0)
+		return -1;
+
+	if (ref->width != scr.var.xres || ref->height != scr.var.yres ||
+	    ref->maxval != 255) {
+		fprintf(stderr, "Reference must be a %ux%u PPM with 8 bit samples\n",
+			scr.var.xres, scr.var.yres);
+		return -1;
+	}
+
+	if (scr.var.bits_per_pixel == 8) {
+		fprintf(stderr, "comparing palette modes not implemented yet\n");
+		return -1;
+	}
+
+	cmp->fb        = &scr;
+	cmp->ref       = ref;
+	cmp->conv      = &ctx->cmp_conv;
+	cmp->tolerance = tolerance;
+	cmp->tiles_x   = (scr.var.xres + CMP_TILE - 1) / CMP_TILE;
+	cmp->tiles_y   = (scr.var.yres + CMP_TILE - 1) / CMP_TILE;
+	cmp->tiles     = ctx->tiles;
+	cmp->diff      = diff;
+
+	memset(cmp->tiles, 0,
+	       (size_t)cmp->tiles_x * cmp->tiles_y * sizeof cmp->tiles[0]);
+
+	mismatches = cmp_run(cmp, &ctx->pool, &sse);
+
+	/* the view is gone after returning */
+	cmp->fb   = NULL;
+	cmp->ref  = NULL;
+	cmp->diff = NULL;
+
+	pixels = (uint64_t)scr.var.xres * scr.var.yres;
+
+	res->mismatches = mismatches;
+	res->pixels     = pixels;
+	res->psnr       = (sse == 0 ? INFINITY :
+			   10 * log10(255.0 * 255.0 * 3 * pixels / sse));
+
+	return mismatches > 0 ? 1 : 0;
+}
+
+void fbt_compare_regions(struct fbt_ctx *ctx,
+			 void (*fn)(struct fbt_region const *region, void *data),
+			 void *data)
+{
+	if (ctx->cmp.tiles_y == 0)
+		return;
+
+	cmp_regions(&ctx->cmp, ctx->seen, ctx->stack, fn, data);
+}
+
+/* Pre-renders all entries of a sequence into the spare pages of the
+ * virtual screen and switches between them by panning.  When there are
+ * not enough pages, entries are rendered into shadow buffers and copied
+ * into the back page (or into the only page) before their switch time. */
+int fbt_play_sequence(struct fbt_ctx *ctx, char const *fname,
+		      void (*fn)(struct fbt_seq_timing const *timing,
+				 void *data),
+		      void *data)
+{
+	struct fbinfo		*fb = &ctx->fb;
+	struct sequence		seq;
+	struct fb_var_screeninfo pan_var;
+	unsigned int		num_pages;
+	unsigned int		cur_page;
+	size_t			page_size;
+	bool			use_pages;
+	bool			have_vsync = true;
+	unsigned int		rot = ctx->rot;
+	uint64_t		t0;
+	uint64_t		sched;
+	int			rc = -1;
+
+	if (sequence_read(fname, &seq) < 0)
+		return -1;
+
+	page_size = fb->stride * fb->var.yres;
+	num_pages = fb->var.yres_virtual / fb->var.yres;
+	cur_page  = fb->var.yoffset / fb->var.yres;
+	use_pages = num_pages >= 2 && seq.num <= num_pages;
+
+	for (size_t i = 0; i < seq.num; ++i) {
+		struct seq_entry	*e = &seq.entries[i];
+		struct fbinfo		page = *fb;
+		struct fbinfo		view;
+		int			rc_render;
+
+		if (use_pages) {
+			/* the currently visible page is rendered last */
+			e->page  = (cur_page + 1 + i) % num_pages;
+			e->frame = (char *)fb->buf + e->page * page_size;
+		} else {
+			e->frame = malloc(page_size);
+			if (!e->frame) {
+				perror("malloc(<shadow>)");
+				goto out;
+			}
+			e->is_shadow = true;
+		}
+
+		page.buf              = e->frame;
+		page.buf_size         = page_size;
+		page.var.yres_virtual = fb->var.yres;
+
+		if (fb_rot_view(&page, rot, ctx->shadow, &view, false) < 0)
+			goto out;
+
+		rc_render = sequence_render(&view, e);
+		fb_rot_commit(&page, rot, &view);
+
+		if (rc_render < 0) {
+			fprintf(stderr, "%s:%u: failed to render '%s'\n",
+				fname, e->lineno, e->pattern);
+			goto out;
+		}
+	}
+
+	pan_var = fb->var;
+	t0      = now_ns();
+	sched   = t0;
+
+	for (size_t i = 0; i < seq.num; ++i) {
+		struct seq_entry	*e = &seq.entries[i];
+		struct timespec		ts = ns_to_ts(sched);
+		uint64_t		t;
+
+		if (e->is_shadow && num_pages >= 2) {
+			e->page = (cur_page + 1) % num_pages;
+			memcpy((char *)fb->buf + e->page * page_size, e->frame,
+			       page_size);
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+
+		/* without a back page, the frame can be copied only at the
+		 * switch time */
+		if (e->is_shadow && num_pages < 2) {
+			e->page = cur_page;
+			memcpy((char *)fb->buf + e->page * page_size, e->frame,
+			       page_size);
+		}
+
+		if (e->page != cur_page) {
+			pan_var.xoffset = 0;
+			pan_var.yoffset = e->page * fb->var.yres;
+
+			if (ioctl(fb->fd, FBIOPAN_DISPLAY, &pan_var) < 0) {
+				perror("ioctl(FBIOPAN_DISPLAY)");
+				goto out;
+			}
+
+			cur_page = e->page;
+			fb->var.yoffset = pan_var.yoffset;
+		}
+
+		/* the pan becomes visible with the next vsync */
+		if (have_vsync) {
+			uint32_t	crtc = 0;
+
+			have_vsync = ioctl(fb->fd, FBIO_WAITFORVSYNC, &crtc) == 0;
+		}
+
+		t = now_ns();
+		if (fn) {
+			struct fbt_seq_timing const	timing = {
+				.index     = i,
+				.num       = seq.num,
+				.pattern   = e->pattern,
+				.scheduled = (sched - t0) / 1e6,
+				.actual    = (t - t0) / 1e6,
+				.shadow    = !use_pages,
+			};
+
+			fn(&timing, data);
+		}
+
+		sched += (uint64_t)e->duration_ms * 1000000u;
+	}
+
+	/* keep the last entry visible for its duration */
+	{
+		struct timespec		ts = ns_to_ts(sched);
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
+	}
+
+	rc = 0;
+
+out:
+	sequence_free(&seq);
+	return rc;
+}
@@ -0,0 +1,180 @@
+/*	--*- c -*--
+ * Copyright (C) 2015 Enrico Scholz <enrico.scholz@sigma-chemnitz.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; version 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef H_LIBFBTEST_H
+#define H_LIBFBTEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <linux/fb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A context wraps an opened (or attached) framebuffer together with the
+ * conversion tables and scratch buffers for it.  Buffers are allocated
+ * when the context is set up or by the first call which needs them;
+ * repeated calls do not allocate.  Contexts are not thread safe.
+ *
+ * Coordinates and images are in the upright (logical) orientation; see
+ * fbt_set_rotation().  Errors are reported on stderr and by a negative
+ * return value. */
+struct fbt_ctx;
+
+enum fbt_pattern {
+	FBT_PATTERN_BARS,
+	FBT_PATTERN_DSHADE,
+	FBT_PATTERN_CROSS,
+};
+
+/* RGB image with rows of 'width' pixels and no padding; samples have 8
+ * bit (maxval 255) or 16 bit in big endian order (maxval 65535), like
+ * the data of a binary PPM */
+struct fbt_image {
+	unsigned int		width;
+	unsigned int		height;
+	unsigned int		maxval;
+	uint8_t const		*data;
+
+	/* backing mapping of fbt_ppm_open() */
+	void			*map;
+	size_t			map_size;
+};
+
+struct fbt_cmp_result {
+	uint64_t		mismatches;
+	uint64_t		pixels;
+	double			psnr;	/* INFINITY for identical images */
+};
+
+/* bounding box (inclusive) of adjacent mismatching pixels */
+struct fbt_region {
+	unsigned int		x0;
+	unsigned int		y0;
+	unsigned int		x1;
+	unsigned int		y1;
+	unsigned int		pixels;
+};
+
+/* opens a framebuffer device or a --grab-raw dump */
+struct fbt_ctx	*fbt_open(char const *fbdev);
+
+/* uses caller provided memory with 'yres_virtual' lines of 'xres_virtual'
+ * pixels as framebuffer; it must stay valid until fbt_close() */
+struct fbt_ctx	*fbt_attach(void *buf, struct fb_var_screeninfo const *var);
+
+void		fbt_close(struct fbt_ctx *ctx);
+
+/* physical screen information */
+struct fb_var_screeninfo const	*fbt_var(struct fbt_ctx const *ctx);
+
+/* size of the screen in its upright orientation */
+void		fbt_geometry(struct fbt_ctx const *ctx,
+			     unsigned int *width, unsigned int *height);
+
+/* 'rotate' is 0, 90, 180 or 270 degrees, or -1 for the rotation reported
+ * by the driver (the default) */
+int		fbt_set_rotation(struct fbt_ctx *ctx, int rotate);
+
+/* directory for rendered patterns; NULL disables the cache */
+int		fbt_set_cache_dir(struct fbt_ctx *ctx, char const *dir);
+
+/* Translates a color specification into a native pixel value.  For 8 bpp
+ * this programs the colormap and accepts '#<idx>', 'g<grey>', 'p' and
+ * '<bar>'; packed formats take a grey level and others the raw value. */
+int		fbt_parse_color(struct fbt_ctx *ctx, char const *spec,
+				uint64_t *col);
+
+/* fills the whole virtual screen with the native value 'col' */
+int		fbt_fill(struct fbt_ctx *ctx, uint64_t col);
+
+/* returns 1 when the pattern was loaded from the cache, 0 when it was
+ * rendered */
+int		fbt_pattern(struct fbt_ctx *ctx, enum fbt_pattern pattern);
+
+int		fbt_set_pixel(struct fbt_ctx *ctx, unsigned int x,
+			      unsigned int y, uint64_t col);
+
+/* copies the image into the top left corner; the uncovered area is
+ * cleared */
+int		fbt_blit(struct fbt_ctx *ctx, struct fbt_image const *img);
+
+/* returns the size of the buffer for fbt_grab() and the maxval of its
+ * samples */
+size_t		fbt_grab_size(struct fbt_ctx const *ctx, unsigned int *maxval);
+
+/* converts the screen into an RGB image as described by fbt_grab_size() */
+int		fbt_grab(struct fbt_ctx *ctx, void *dst, size_t dst_size);
+
+/* Converts the screen into a binary PPM and writes it to all 'fds' at
+ * once.  Conversion and output overlap; the data is written with
+ * io_uring when available and by a writer thread otherwise.  When 'crc'
+ * is not NULL, it receives the CRC-32 of the PPM.  A sink whose write
+ * fails is dropped; the result is -1 then.  The buffers and the ring or
+ * thread are set up by the first call and kept with the context. */
+int		fbt_grab_write(struct fbt_ctx *ctx, int const *fds,
+			       unsigned int num_fds, uint32_t *crc);
+
+/* writes a --grab-raw dump of the visible screen */
+int		fbt_grab_raw(struct fbt_ctx *ctx, int fd);
+
+/* CRC-32 (IEEE 802.3) of the visible screen in native pixel format, row
+ * by row without padding; it does not depend on the rotation */
+uint32_t	fbt_checksum(struct fbt_ctx const *ctx);
+
+/* Compares the screen against an RGB image with 8 bit samples.  When
+ * 'diff' is not NULL, a diff image of the same size is written into it.
+ * Returns 0 when the screen matches, 1 on mismatches and -1 on errors. */
+int		fbt_compare(struct fbt_ctx *ctx, struct fbt_image const *ref,
+			    unsigned int tolerance, uint8_t *diff,
+			    struct fbt_cmp_result *res);
+
+/* reports the mismatching regions of the last fbt_compare() */
+void		fbt_compare_regions(struct fbt_ctx *ctx,
+				    void (*fn)(struct fbt_region const *region,
+					       void *data),
+				    void *data);
+
+/* switch time of a sequence entry in ms relative to the start */
+struct fbt_seq_timing {
+	size_t			index;
+	size_t			num;	/* entries of the sequence */
+	char const		*pattern;
+	double			scheduled;
+	double			actual;
+	/* entries did not fit into the virtual screen and are copied from
+	 * shadow buffers */
+	bool			shadow;
+};
+
+/* plays a --sequence file; 'fn' (when not NULL) is called after each
+ * switch */
+int		fbt_play_sequence(struct fbt_ctx *ctx, char const *fname,
+				  void (*fn)(struct fbt_seq_timing const *timing,
+					     void *data),
+				  void *data);
+
+/* maps a binary PPM (P6) with a maxval of 255 or 65535 */
+int		fbt_ppm_open(char const *fname, struct fbt_image *img);
+void		fbt_ppm_close(struct fbt_image *img);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* H_LIBFBTEST_H */